@@ -9,319 +9,3394 @@
 #include <unistd.h>
 
 #include <stdint.h>
+#if defined(MEM_ARENAS)
+#include <pthread.h>
+#endif
 
 #include "mem_alloc_types.h"
 #include "my_mmap.h"
 
-/* pointer to the beginning of the memory region to manage */
+/* Buddy blocks cannot hold a page aligned on a page boundary, and larger alignments leave no size class: no slabs */
+#if defined(MEM_SLAB) && (defined(BUDDY) || MEM_ALIGNMENT > 64)
+#undef MEM_SLAB
+#endif
+
+/* The buddy system already reuses the blocks of a size without searching: no quick lists */
+#if defined(MEM_QUICK) && defined(BUDDY)
+#undef MEM_QUICK
+#endif
+
+/* The lock-free slabs need threads to make sense, and take the place of the slabs of the arenas */
+#if defined(MEM_LFSLAB) && (!defined(MEM_ARENAS) || MEM_ALIGNMENT > 64)
+#undef MEM_LFSLAB
+#endif
+#if defined(MEM_LFSLAB) && defined(MEM_SLAB)
+#undef MEM_SLAB
+#endif
+
+/* The thread caches only make sense with locks to avoid, and need a header to find the size of a freed block: not with slabs */
+#if defined(MEM_TCACHE) && (!defined(MEM_ARENAS) || defined(BUDDY) || defined(MEM_SLAB))
+#undef MEM_TCACHE
+#endif
+
+/* The per-CPU caches are written for x86-64, with the restartable sequences registered by glibc (2.35 and later) */
+#if defined(MEM_PCPU)
+#if !defined(MEM_TCACHE) || !defined(__x86_64__) || !defined(__GLIBC__)
+#undef MEM_PCPU
+#elif !__GLIBC_PREREQ(2, 35)
+#undef MEM_PCPU
+#endif
+#endif
+#if defined(MEM_PCPU)
+#include <sys/rseq.h>
+#endif
+
+/* The blocks freed by another thread only go to a list of their arena when there are several arenas */
+#if defined(MEM_REMOTE) && (!defined(MEM_ARENAS) || MEM_ARENAS < 2)
+#undef MEM_REMOTE
+#endif
+
+/* pointer to the beginning of the memory region to manage (the first chunk of the first arena) */
 void *heap_start;
 
-/* Pointer to the first free block in the heap */
-mb_free_t *first_free;
+#define ULONG(x)((long unsigned int)(x))
+
+/* Size of a block (metadata included), without the flags */
+#define BLOCK_SIZE(b) MB_SIZE(((mb_free_t *)(b))->size)
+
+/* Block located immediately after b (b must not be flagged MB_LAST) */
+#define NEXT_BLOCK(b) ((mb_free_t *)((char *)(b) + BLOCK_SIZE(b)))
+
+/* Footer of a free block of the given size */
+#define FOOTER(b, size) ((size_t *)((char *)(b) + (size)) - 1)
+
+/* Block located immediately before b (b must be flagged MB_PREV_FREE) */
+#define PREV_BLOCK(b) ((mb_free_t *)((char *)(b) - *((size_t *)(b) - 1)))
+
+/* Payload of an allocated block, and allocated block of a payload */
+#define PAYLOAD(b) ((void *)((char *)(b) + MB_HEADER_SIZE))
+#define HEADER(p) ((mb_allocated_t *)((char *)(p) - MB_HEADER_SIZE))
+
+/*
+ * MB_PREV_FREE is set and cleared in the header of the block that follows
+ * a block being freed, merged or allocated: that block may be allocated
+ * and owned by another thread. With arenas, the owner reads the header of
+ * its block without any lock (memory_free and memory_realloc look for
+ * MB_MAPPED, tcache_put and memory_get_allocated_block_size for the size),
+ * while the thread holding the lock of the arena updates that flag in the
+ * same word. Both sides use atomic operations on the word; the size and
+ * the other flags of an allocated block are only written by its owner, so
+ * the bits read without the lock never change under it.
+ */
+#if defined(MEM_ARENAS)
+#define SET_PREV_FREE(b) __atomic_fetch_or(&(b)->size, MB_PREV_FREE, __ATOMIC_RELAXED)
+#define CLEAR_PREV_FREE(b) __atomic_fetch_and(&(b)->size, ~MB_PREV_FREE, __ATOMIC_RELAXED)
+#define UNLOCKED_SIZE(b) __atomic_load_n(&(b)->size, __ATOMIC_RELAXED)
+#else
+#define SET_PREV_FREE(b) ((b)->size |= MB_PREV_FREE)
+#define CLEAR_PREV_FREE(b) ((b)->size &= ~MB_PREV_FREE)
+#define UNLOCKED_SIZE(b) ((b)->size)
+#endif
+
+/* Rounds x up to a multiple of the power of two a */
+#define ALIGN_UP(x, a) (((uintptr_t)(x) + (a) - 1) & ~((uintptr_t)(a) - 1))
+
+/* Mappings are made of whole pages */
+#define MEM_PAGE_SIZE 4096
+#define PAGE_ROUND(x) ((size_t)ALIGN_UP(x, MEM_PAGE_SIZE))
+#define PAGE_FLOOR(x) ((char *)((uintptr_t)(x) & ~((uintptr_t)MEM_PAGE_SIZE - 1)))
+
+/*
+ * Largest request (and alignment): the size of its block, with the padding
+ * of an aligned request or the rounding of a mapping, cannot overflow and
+ * leaves the bits of the flags (MB_FLAGS) alone. Larger requests fail.
+ */
+#define MEM_MAX_SIZE (~MB_FLAGS / 4)
+
+/*
+ * The heap is made of chunks mapped with my_mmap_pool. The first chunk holds
+ * MEM_POOL_SIZE bytes and starts at heap_start. With MEM_GROW, a new chunk
+ * is mapped each time no free block is large enough: it is at least as
+ * large as the whole heap, so the number of chunks stays small. The last
+ * block of each chunk is flagged MB_LAST, so blocks are never merged
+ * across chunks.
+ */
+#define MEM_MAX_CHUNKS 64
+
+struct mem_chunk {
+    void *start;
+    size_t size;
+#if defined(MEM_SLAB)
+    unsigned char *slab_pages;  /* one bit per page of the chunk, set for the pages that are slabs */
+#endif
+};
+
+#if defined(MEM_SLAB)
+#define SLAB_MAP_SIZE(size) (((size) / MEM_PAGE_SIZE + 1) / 8 + 1)
+#endif
+
+/* Sizes of the arrays of the policies and of the caches (see their sections) */
+#if defined(TLSF)
+#define TLSF_SL_LOG2 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_FL_COUNT (sizeof(size_t) * 8)
+#elif defined(BUDDY)
+#define BUDDY_NB_ORDERS (sizeof(size_t) * 8)
+#elif defined(SEGREGATED_FIT)
+#define SF_SMALL_LIMIT 256
+#define SF_SMALL_LIMIT_LOG2 8
+#define SF_NB_CLASSES (SF_SMALL_LIMIT + sizeof(size_t) * 8 - SF_SMALL_LIMIT_LOG2)
+#define SF_BITMAP_WORDS ((SF_NB_CLASSES + 63) / 64)
+#endif
+
+#if defined(MEM_QUICK)
+#define QUICK_MAX_SIZE 128
+#endif
+
+#if defined(MEM_SLAB)
+#define SLAB_MAX_SIZE 64
+#define SLAB_GRANULE (MEM_ALIGNMENT > 8 ? MEM_ALIGNMENT : 8)
+#define SLAB_NB_CLASSES (SLAB_MAX_SIZE / SLAB_GRANULE)
+#endif
+
+/*
+ * An arena is a heap of its own: its chunks, its free blocks, the index of
+ * the policy and the caches. With MEM_ARENAS, the allocator has MEM_ARENAS
+ * arenas, each one protected by its own lock, and the threads are spread
+ * over them (see arena_lock_thread); a block always goes back to the arena
+ * whose chunks hold it. Without MEM_ARENAS, there is a single arena and no
+ * locking at all.
+ *
+ * The code works on the current arena, the one 'arena' points to: the names
+ * defined below the structure stand for the fields of the current arena, so
+ * that the policies are written as for a single heap.
+ */
+struct arena {
+#if defined(MEM_ARENAS)
+    pthread_mutex_t lock;
+#endif
+    mb_free_t *first_free;      /* first free block of the list policies */
+    struct mem_stats stats;     /* number and total size of the free blocks, ... */
+    struct mem_chunk chunks[MEM_MAX_CHUNKS];
+    int nb_chunks;
+#if defined(FIRST_FIT) || defined(BEST_FIT) || defined(NEXT_FIT)
+    mb_free_t *fl_hint;
+#if defined(NEXT_FIT)
+    mb_free_t *next_fit_ptr;    /* where the next search starts */
+#endif
+#elif defined(FIRST_FIT_TREE) || defined(BEST_FIT_TREE)
+    mb_free_t *tree_root;
+#elif defined(WORST_FIT)
+    mb_free_t **wf_heap;
+    size_t wf_heap_size;
+    size_t wf_heap_capacity;
+#elif defined(TLSF)
+    mb_free_t *tlsf_lists[TLSF_FL_COUNT][TLSF_SL_COUNT];
+    uint64_t tlsf_fl_bitmap;
+    uint32_t tlsf_sl_bitmap[TLSF_FL_COUNT];
+#elif defined(BUDDY)
+    mb_free_t *buddy_lists[BUDDY_NB_ORDERS];
+    uint64_t buddy_bitmap;
+#elif defined(SEGREGATED_FIT)
+    mb_free_t *sf_classes[SF_NB_CLASSES];
+    uint64_t sf_bitmap[SF_BITMAP_WORDS];
+#endif
+#if !defined(BUDDY)
+    mb_free_t *top;             /* top block (MEM_TOP) */
+    char *top_end;
+    size_t largest;             /* bound of the size of the largest free block */
+    int largest_exact;
+    size_t search_limit;
+    size_t size_counts[64];
+    uint64_t size_classes;
+#endif
+#if defined(MEM_QUICK)
+    mb_allocated_t *quick[QUICK_MAX_SIZE + 1];
+    size_t quick_bytes;
+#endif
+#if defined(MEM_SLAB)
+    struct slab *slabs[SLAB_NB_CLASSES];
+#endif
+#if defined(MEM_REMOTE)
+    unsigned chunks_seq;        /* odd while the chunks change (see arena_find) */
+    /* blocks freed by the threads of other arenas, on a cache line of its own (see remote_free) */
+    void *remote_frees __attribute__((aligned(64)));
+#endif
+} __attribute__((aligned(64)));    /* the arenas do not share cache lines */
+
+#define first_free (arena->first_free)
+#define stats (arena->stats)
+#define chunks (arena->chunks)
+#define nb_chunks (arena->nb_chunks)
+#define fl_hint (arena->fl_hint)
+#define next_fit_ptr (arena->next_fit_ptr)
+#define tree_root (arena->tree_root)
+#define wf_heap (arena->wf_heap)
+#define wf_heap_size (arena->wf_heap_size)
+#define wf_heap_capacity (arena->wf_heap_capacity)
+#define tlsf_lists (arena->tlsf_lists)
+#define tlsf_fl_bitmap (arena->tlsf_fl_bitmap)
+#define tlsf_sl_bitmap (arena->tlsf_sl_bitmap)
+#define buddy_lists (arena->buddy_lists)
+#define buddy_bitmap (arena->buddy_bitmap)
+#define sf_classes (arena->sf_classes)
+#define sf_bitmap (arena->sf_bitmap)
+#define top (arena->top)
+#define top_end (arena->top_end)
+#define largest (arena->largest)
+#define largest_exact (arena->largest_exact)
+#define search_limit (arena->search_limit)
+#define size_counts (arena->size_counts)
+#define size_classes (arena->size_classes)
+#define quick (arena->quick)
+#define quick_bytes (arena->quick_bytes)
+#define slabs (arena->slabs)
+
+#if defined(MEM_ARENAS)
+static struct arena arenas[MEM_ARENAS] = {
+    [0 ... MEM_ARENAS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+/* Arena assigned to the calling thread, and arena the calling thread has locked (the current arena) */
+static __thread struct arena *thread_arena __attribute__((tls_model("initial-exec")));
+static __thread struct arena *arena __attribute__((tls_model("initial-exec")));
+
+/* Number of threads that have been assigned an arena */
+static unsigned nb_threads = 0;
+#else
+static struct arena arenas[1];
+static struct arena *const arena = &arenas[0];
+#endif
+
+#define NB_ARENAS ((int)(sizeof(arenas) / sizeof(arenas[0])))
+
+#if defined(MEM_ARENAS) || defined(MEM_SLAB) || defined(BUDDY)
+/* Chunk of the current arena that holds p, or NULL */
+static struct mem_chunk *chunk_of(void *p)
+{
+    for (int i = 0; i < nb_chunks; i++) {
+        if ((size_t)((char *)p - (char *)chunks[i].start) < chunks[i].size) {
+            return &chunks[i];
+        }
+    }
+    return NULL;
+}
+#endif
+
+/* Maps the first chunk of the current arena, and makes it a single free block */
+static void arena_init(void);
+
+/* Allocates a block of the current arena for 'size' bytes (see memory_alloc) */
+static void *arena_alloc(size_t size);
+
+#if defined(MEM_TCACHE)
+/* Gives the blocks of the cache of the calling thread back to their arenas, returns 0 if there was none */
+static int tcache_drain(void);
+#endif
+
+#if defined(MEM_REMOTE)
+/* Frees the block of p, held by the current arena (or mapped) */
+static void arena_free(void *p);
+
+/* Frees the blocks of the list of remote frees of the current arena */
+static void remote_drain(void);
+#endif
+
+#if defined(MEM_ARENAS)
+/* Locks the arena a, and makes it the current arena */
+static void arena_lock(struct arena *a)
+{
+    pthread_mutex_lock(&a->lock);
+    arena = a;
+#if defined(MEM_REMOTE)
+    remote_drain();
+#endif
+}
+
+static void arena_unlock(void)
+{
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/*
+ * Locks the arena of the calling thread, and makes it the current arena.
+ * A thread is assigned the next arena (round-robin) on its first call. When
+ * its arena is locked by another thread, it takes the first arena that is
+ * not, and keeps it for its next calls: the threads that contend for an
+ * arena spread over the others. The first chunk of an arena is mapped when
+ * the arena is used for the first time.
+ */
+static void arena_lock_thread(void)
+{
+    struct arena *a = thread_arena;
+    int i;
+
+    if (a == NULL) {
+        a = &arenas[__atomic_fetch_add(&nb_threads, 1, __ATOMIC_RELAXED) % MEM_ARENAS];
+    }
+    if (pthread_mutex_trylock(&a->lock) != 0) {
+        for (i = 1; i < MEM_ARENAS; i++) {
+            struct arena *other = &arenas[(a - arenas + i) % MEM_ARENAS];
+            if (pthread_mutex_trylock(&other->lock) == 0) {
+                a = other;
+                break;
+            }
+        }
+        if (i == MEM_ARENAS) {
+            pthread_mutex_lock(&a->lock);
+        }
+    }
+    thread_arena = a;
+    arena = a;
+    if (nb_chunks == 0) {
+        arena_init();
+    }
+#if defined(MEM_REMOTE)
+    remote_drain();
+#endif
+}
+
+/*
+ * Locks the arena whose chunks hold p. The arena of the calling thread is
+ * looked at first, since most blocks are freed by the thread that allocated
+ * them. A block held by no arena (a mapped block) is handled by the arena of
+ * the calling thread.
+ */
+static void arena_lock_owner(void *p)
+{
+    arena_lock_thread();
+    if (chunk_of(p) != NULL) {
+        return;
+    }
+    struct arena *own = arena;
+    arena_unlock();
+    for (int i = 0; i < MEM_ARENAS; i++) {
+        if (&arenas[i] != own) {
+            arena_lock(&arenas[i]);
+            if (chunk_of(p) != NULL) {
+                return;
+            }
+            arena_unlock();
+        }
+    }
+    arena_lock(own);
+}
+
+/*
+ * fork: the child only has the thread that called fork, so none of the
+ * locks of the arenas may be held by another thread at that time (the child
+ * would find it locked forever). The calling thread takes the locks of all
+ * the arenas, in their order, before the fork; the parent releases them,
+ * and the child initializes them again. The rest of the state shared by
+ * the threads only changes under these locks, or with single atomic
+ * instructions (lists of remote frees, lock-free slabs): the child finds
+ * it consistent. The blocks in the caches of the other threads stay
+ * allocated in the child.
+ */
+static void arena_fork_prepare(void)
+{
+    for (int a = 0; a < MEM_ARENAS; a++) {
+        pthread_mutex_lock(&arenas[a].lock);
+    }
+}
+
+static void arena_fork_parent(void)
+{
+    for (int a = MEM_ARENAS - 1; a >= 0; a--) {
+        pthread_mutex_unlock(&arenas[a].lock);
+    }
+}
+
+static void arena_fork_child(void)
+{
+    for (int a = 0; a < MEM_ARENAS; a++) {
+        pthread_mutex_init(&arenas[a].lock, NULL);
+    }
+}
+
+#if defined(MEM_REMOTE)
+/*
+ * Remote frees: a thread that frees a block of another arena does not
+ * take the lock of that arena, it pushes the block on the list of remote
+ * frees of the arena (a stack linked through the payloads, updated with a
+ * compare-and-swap). The thread that locks the arena next, to allocate or
+ * to free, takes the whole list at once and frees its blocks. Until then,
+ * the blocks of the list stay allocated in the stats of the arena.
+ *
+ * The arena of a block is found without any lock: the chunks of an arena
+ * only change under its lock, and chunks_seq is odd while they do. A
+ * lookup that sees chunks_seq change may have read the chunks of an arena
+ * in the middle of a change: it is not trusted, and the block is freed
+ * under the locks (arena_lock_owner). Once a block is known to be in a
+ * chunk of an arena, the chunk cannot go away before the block is freed.
+ */
+
+/* The chunks of the current arena are about to change */
+static void chunks_change_begin(void)
+{
+    __atomic_store_n(&arena->chunks_seq, arena->chunks_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* The chunks of the current arena have changed */
+static void chunks_change_end(void)
+{
+    __atomic_store_n(&arena->chunks_seq, arena->chunks_seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Arena whose chunks hold p, found without locking, or NULL (mapped block, or chunks changing) */
+static struct arena *arena_find(void *p)
+{
+    for (int a = 0; a < MEM_ARENAS; a++) {
+        // The names of the fields stand for the ones of the arena looked at, which is not locked
+        struct arena *arena = &arenas[a];
+        unsigned seq = __atomic_load_n(&arena->chunks_seq, __ATOMIC_ACQUIRE);
+        int n = __atomic_load_n(&nb_chunks, __ATOMIC_RELAXED);
+
+        for (int i = 0; i < n; i++) {
+            char *start = __atomic_load_n(&chunks[i].start, __ATOMIC_RELAXED);
+            size_t size = __atomic_load_n(&chunks[i].size, __ATOMIC_RELAXED);
+            if ((size_t)((char *)p - start) < size) {
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if ((seq & 1) || __atomic_load_n(&arena->chunks_seq, __ATOMIC_RELAXED) != seq) {
+                    return NULL;
+                }
+                return arena;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Pushes p on the list of remote frees of its arena, returns 0 if it is a block of the arena of the calling thread, or if its arena is not known */
+static int remote_free(void *p)
+{
+    struct arena *owner = arena_find(p);
+
+    if (owner == NULL || owner == thread_arena) {
+        return 0;
+    }
+    void *head = __atomic_load_n(&owner->remote_frees, __ATOMIC_RELAXED);
+    do {
+        *(void **)p = head;
+    } while (!__atomic_compare_exchange_n(&owner->remote_frees, &head, p, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return 1;
+}
+
+static void remote_drain(void)
+{
+    if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+    void *list = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while (list != NULL) {
+        void *next = *(void **)list;
+        arena_free(list);
+        list = next;
+    }
+}
+#endif
+#else
+#define arena_lock(a)
+#define arena_unlock()
+#define arena_lock_owner(p) arena_lock_thread()
+
+static void arena_lock_thread(void)
+{
+    if (nb_chunks == 0) {
+        arena_init();
+    }
+}
+#endif
+
+#if !defined(MEM_REMOTE)
+#define chunks_change_begin()
+#define chunks_change_end()
+#endif
+
+#if defined(WORST_FIT)
+/* Makes the heap of free blocks large enough for a new chunk of 'size' bytes, returns 0 on failure */
+static int wf_reserve(size_t size);
+#endif
+
+/* Maps a new chunk of the given size, returns its address or NULL */
+static void *add_chunk(size_t size)
+{
+    void *start;
+
+    if (nb_chunks == MEM_MAX_CHUNKS) {
+        return NULL;
+    }
+    start = my_mmap_pool(size);
+    if (start == NULL) {
+        return NULL;
+    }
+#if defined(MEM_SLAB)
+    chunks[nb_chunks].slab_pages = my_mmap(SLAB_MAP_SIZE(size));
+    if (chunks[nb_chunks].slab_pages == NULL) {
+        my_munmap_pool(start, size);
+        return NULL;
+    }
+#endif
+#if defined(WORST_FIT)
+    if (!wf_reserve(size)) {
+        my_munmap_pool(start, size);
+        return NULL;
+    }
+#endif
+    chunks_change_begin();
+    chunks[nb_chunks].start = start;
+    chunks[nb_chunks].size = size;
+    nb_chunks++;
+    chunks_change_end();
+    stats.heap_bytes += size;
+    return start;
+}
+
+/*
+ * Counts an allocation of 'size' bytes, served by a block of block_size
+ * bytes, in the stats of the current arena. The thread caches hand their
+ * blocks out without taking the lock of the arena: with them, the counters
+ * are updated atomically.
+ */
+static void count_alloc(size_t size, size_t block_size)
+{
+#if defined(MEM_TCACHE)
+    __atomic_fetch_add(&stats.nb_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.requested_bytes, size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.allocated_bytes, block_size, __ATOMIC_RELAXED);
+#else
+    stats.nb_allocs++;
+    stats.requested_bytes += size;
+    stats.allocated_bytes += block_size;
+#endif
+}
+
+#if defined(MEM_ARENAS)
+/* Makes sure there is a current arena to count in what is done without its lock (mapped blocks, thread caches) */
+static void stats_arena(void)
+{
+    if (arena == NULL) {
+        arena = thread_arena != NULL ? thread_arena : &arenas[0];
+    }
+}
+#endif
+
+/* Blocks with their own mapping: large requests, and aligned requests of the buddy system */
+#if defined(MEM_MMAP_THRESHOLD) || defined(BUDDY)
+#define MEM_MAPPED_BLOCKS
+
+/*
+ * Requests of at least MEM_MMAP_THRESHOLD bytes do not come from the heap:
+ * each one gets its own mapping. The header of the block is flagged
+ * MB_MAPPED and holds the size of the whole mapping; it is in the first
+ * page of the mapping (the payload is aligned on 'alignment', so the header
+ * does not always start the mapping). Freeing such a block unmaps it, so
+ * the memory goes back to the system at once and the free lists never
+ * see it.
+ */
+
+/* Start of the mapping of a mapped block (my_mmap adds no padding when MEM_ALIGNMENT divides the page size) */
+#define MAPPING(b) PAGE_FLOOR(b)
+
+static void *mapped_alloc(size_t size, size_t alignment)
+{
+    // The length of the mapping would overflow
+    if (size > MEM_MAX_SIZE || alignment > MEM_MAX_SIZE) {
+        print_alloc_error(size);
+        return NULL;
+    }
+    size_t length = PAGE_ROUND(MB_HEADER_SIZE + size + (alignment > MB_HEADER_SIZE ? alignment : 0));
+    char *start = my_mmap(length);
+
+    if (start == NULL) {
+        print_alloc_error(size);
+        return NULL;
+    }
+    char *payload = (char *)ALIGN_UP(start + MB_HEADER_SIZE, alignment);
+
+    // The pages located before the header, or after the payload, are given back
+    char *mapping = MAPPING(HEADER(payload));
+    char *end = (char *)PAGE_ROUND(payload + size);
+    if (mapping != start) {
+        my_munmap(start, mapping - start);
+    }
+    if (end != start + length) {
+        my_munmap(end, start + length - end);
+    }
+    length = end - mapping;
+    HEADER(payload)->size = length | MB_MAPPED;
+    __atomic_fetch_add(&stats.mapped_bytes, length, __ATOMIC_RELAXED);
+    count_alloc(size, length);
+
+    print_alloc_info(payload, size);
+    return payload;
+}
+
+static void mapped_free(mb_allocated_t *block)
+{
+    __atomic_fetch_sub(&stats.mapped_bytes, MB_SIZE(block->size), __ATOMIC_RELAXED);
+    my_munmap(MAPPING(block), MB_SIZE(block->size));
+}
+
+/* Resizes a mapped block with my_mremap: the pages are moved, not copied */
+static void *mapped_realloc(mb_allocated_t *block, size_t size)
+{
+    char *mapping = MAPPING(block);
+    size_t offset = (char *)block - mapping;
+    size_t old_length = MB_SIZE(block->size);
+
+    // The length of the mapping would overflow
+    if (size > MEM_MAX_SIZE) {
+        print_alloc_error(size);
+        return NULL; // The block is left untouched
+    }
+    size_t length = PAGE_ROUND(offset + MB_HEADER_SIZE + size);
+
+    if (length != old_length) {
+        mapping = my_mremap(mapping, old_length, length);
+        if (mapping == NULL) {
+            print_alloc_error(size);
+            return NULL; // The block is left untouched
+        }
+        block = (mb_allocated_t *)(mapping + offset);
+        block->size = length | MB_MAPPED;
+        __atomic_fetch_add(&stats.mapped_bytes, length - old_length, __ATOMIC_RELAXED);
+    }
+    return PAYLOAD(block);
+}
+
+#if defined(MEM_ARENAS) && !defined(MEM_SLAB)
+/*
+ * A mapped block belongs to no arena: memory_free and memory_realloc handle
+ * it without taking any lock (arena_lock_owner would lock every arena in
+ * turn before finding that none holds the block). The mapped bytes of the
+ * stats are updated atomically for that reason. With MEM_SLAB, the word
+ * before a slot is not a header: the slabs of the arena must be looked at
+ * first, under its lock.
+ */
+#define MAPPED_UNLOCKED
+#endif
+#endif
+
+#if defined(MEM_GROW)
+/* Size of the chunk to map when no free block holds block_size bytes */
+static size_t grow_size(size_t block_size)
+{
+    return PAGE_ROUND(stats.heap_bytes > block_size ? stats.heap_bytes : block_size);
+}
+#endif
+
+/*
+ * Each policy provides the index of the free blocks through four functions:
+ *   - fl_insert: adds a free block (header and footer already written)
+ *   - fl_remove: removes a free block, before it is allocated or merged
+ *   - fl_find: returns a free block of at least 'size' bytes, or NULL
+ *   - fl_largest: returns the size of the largest indexed block, or 0
+ * Coalescing only relies on the boundary tags, so the index is never walked
+ * to find the neighbours of a block. The index is part of the state of the
+ * current arena (see struct arena).
+ */
+
+#if defined(FIRST_FIT) || defined(BEST_FIT) || defined(NEXT_FIT)
+
+/*
+ * The free blocks are kept in a doubly-linked list sorted by address.
+ * After a block has been removed, the block that was preceding it is kept
+ * as a hint (fl_hint): the next insertion (the remainder of a split, or
+ * the result of a merge) goes to the same place and does not have to walk
+ * the list. A freed block with no free neighbour has no such hint: it is
+ * inserted after a walk of the list, in O(number of free blocks). The
+ * order by address is part of the specification of these policies (see
+ * README_tests.md); FFT and BFT give the same placements with an index.
+ */
+static void fl_insert(mb_free_t *block)
+{
+    mb_free_t *prev = NULL, *current = first_free;
+
+    if (fl_hint != NULL && fl_hint < block) {
+        prev = fl_hint;
+        current = fl_hint->next;
+    }
+    fl_hint = NULL;
+
+    // Find the correct position to insert the block based on address
+    while (current != NULL && current < block) {
+        prev = current;
+        current = current->next;
+    }
+    block->next = current;
+    block->prev = prev;
+    if (current != NULL) current->prev = block;
+    if (prev != NULL) prev->next = block;
+        else first_free = block;
+}
+
+static void fl_remove(mb_free_t *block)
+{
+    if (block->next != NULL) block->next->prev = block->prev;
+    if (block->prev != NULL) block->prev->next = block->next;
+        else first_free = block->next;
+    fl_hint = block->prev;
+}
+
+/* The list is sorted by address: the largest block is only found by walking it */
+static size_t fl_largest(void)
+{
+    size_t max = 0;
+
+    for (mb_free_t *current = first_free; current != NULL; current = current->next) {
+        if (BLOCK_SIZE(current) > max) {
+            max = BLOCK_SIZE(current);
+        }
+    }
+    return max;
+}
+
+#if defined(FIRST_FIT)
+
+static mb_free_t *fl_find(size_t size)
+{
+    // Traverse the free block list to find a block that fits
+    mb_free_t *current = first_free;
+
+    while (current != NULL && BLOCK_SIZE(current) < size) {
+        current = current->next;
+    }
+    return current;
+}
+
+#elif defined(BEST_FIT)
+
+static mb_free_t *fl_find(size_t size)
+{
+    mb_free_t *current = first_free, *best = NULL;
+
+    while (current != NULL) {
+        if (BLOCK_SIZE(current) >= size) {
+            // Found a suitable block
+            if (best == NULL || BLOCK_SIZE(best) > BLOCK_SIZE(current)) {
+                best = current;
+            }
+            // No block can fit better than an exact match
+            if (BLOCK_SIZE(current) == size) {
+                break;
+            }
+        }
+        // Move to the next block
+        current = current->next;
+    }
+    return best;
+}
+
+#elif defined(NEXT_FIT)
+
+static mb_free_t *fl_find(size_t size)
+{
+    mb_free_t *start = (next_fit_ptr != NULL) ? next_fit_ptr : first_free;
+    mb_free_t *current;
+
+    // Start the search for a block to fit from the next_fit_ptr position ...
+    for (current = start; current != NULL; current = current->next) {
+        if (BLOCK_SIZE(current) >= size) {
+            return current;
+        }
+    }
+    // ... and wrap around to the beginning of the list
+    for (current = first_free; current != start; current = current->next) {
+        if (BLOCK_SIZE(current) >= size) {
+            return current;
+        }
+    }
+    return NULL;
+}
+
+#endif
+
+#elif defined(FIRST_FIT_TREE) || defined(BEST_FIT_TREE)
+
+/*
+ * The free blocks are kept in a balanced tree. The tree is a treap: the
+ * priority of a node is a hash of its address, which keeps the tree
+ * balanced (with high probability) without storing anything else in the
+ * blocks.
+ *
+ * First Fit orders the tree by address. Every node also stores the size
+ * of the largest block of its subtree, so the lowest-addressed block that
+ * fits is found in O(log n) by going down the leftmost subtree that
+ * contains a large enough block.
+ *
+ * Best Fit orders the tree by size, then by address: the best block is
+ * the first one that is not smaller than the request.
+ */
+/* Order of the nodes in the tree */
+static int tree_before(mb_free_t *a, mb_free_t *b)
+{
+#if defined(FIRST_FIT_TREE)
+    return a < b;
+#else
+    return BLOCK_SIZE(a) < BLOCK_SIZE(b) || (BLOCK_SIZE(a) == BLOCK_SIZE(b) && a < b);
+#endif
+}
+
+static uintptr_t tree_priority(mb_free_t *node)
+{
+    return ((uintptr_t)node >> 3) * 0x9E3779B97F4A7C15UL;
+}
+
+#if defined(FIRST_FIT_TREE)
+
+static size_t tree_max(mb_free_t *node)
+{
+    return (node != NULL) ? node->max : 0;
+}
+
+static void tree_update(mb_free_t *node)
+{
+    size_t max = BLOCK_SIZE(node);
+
+    if (tree_max(node->left) > max) max = tree_max(node->left);
+    if (tree_max(node->right) > max) max = tree_max(node->right);
+    node->max = max;
+}
+
+#else
+
+static void tree_update(mb_free_t *node)
+{
+    // Nothing to maintain: the order of the tree is enough to find the best block
+}
+
+#endif
+
+static void tree_rotate_right(mb_free_t **link)
+{
+    mb_free_t *node = *link, *left = node->left;
+
+    node->left = left->right;
+    left->right = node;
+    tree_update(node);
+    tree_update(left);
+    *link = left;
+}
+
+static void tree_rotate_left(mb_free_t **link)
+{
+    mb_free_t *node = *link, *right = node->right;
+
+    node->right = right->left;
+    right->left = node;
+    tree_update(node);
+    tree_update(right);
+    *link = right;
+}
+
+static void tree_insert(mb_free_t **link, mb_free_t *block)
+{
+    mb_free_t *node = *link;
+
+    if (node == NULL) {
+        block->left = block->right = NULL;
+        tree_update(block);
+        *link = block;
+        return;
+    }
+    if (tree_before(block, node)) {
+        tree_insert(&node->left, block);
+        if (tree_priority(node->left) > tree_priority(node)) {
+            tree_rotate_right(link);
+            return;
+        }
+    } else {
+        tree_insert(&node->right, block);
+        if (tree_priority(node->right) > tree_priority(node)) {
+            tree_rotate_left(link);
+            return;
+        }
+    }
+    tree_update(node);
+}
+
+/* Merges two subtrees, all the nodes of 'left' being before the ones of 'right' */
+static mb_free_t *tree_join(mb_free_t *left, mb_free_t *right)
+{
+    if (left == NULL) return right;
+    if (right == NULL) return left;
+
+    if (tree_priority(left) > tree_priority(right)) {
+        left->right = tree_join(left->right, right);
+        tree_update(left);
+        return left;
+    }
+    right->left = tree_join(left, right->left);
+    tree_update(right);
+    return right;
+}
+
+static void tree_remove(mb_free_t **link, mb_free_t *block)
+{
+    mb_free_t *node = *link;
+
+    assert(node != NULL);
+    if (node == block) {
+        *link = tree_join(node->left, node->right);
+        return;
+    }
+    if (tree_before(block, node)) {
+        tree_remove(&node->left, block);
+    } else {
+        tree_remove(&node->right, block);
+    }
+    tree_update(node);
+}
+
+static void fl_insert(mb_free_t *block)
+{
+    tree_insert(&tree_root, block);
+}
+
+static void fl_remove(mb_free_t *block)
+{
+    tree_remove(&tree_root, block);
+}
+
+#if defined(FIRST_FIT_TREE)
+
+static mb_free_t *fl_find(size_t size)
+{
+    mb_free_t *node = tree_root;
+
+    if (tree_max(node) < size) {
+        return NULL;
+    }
+    // Blocks on the left come first: go left whenever a block fits there
+    while (1) {
+        if (tree_max(node->left) >= size) {
+            node = node->left;
+        } else if (BLOCK_SIZE(node) >= size) {
+            return node;
+        } else {
+            node = node->right;
+        }
+    }
+}
+
+static size_t fl_largest(void)
+{
+    return tree_max(tree_root);
+}
+
+#else
+
+static mb_free_t *fl_find(size_t size)
+{
+    mb_free_t *node = tree_root, *best = NULL;
+
+    // Smallest block that fits: go left after each candidate to look for a smaller one
+    while (node != NULL) {
+        if (BLOCK_SIZE(node) >= size) {
+            best = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return best;
+}
+
+/* The largest block is the last one of the tree */
+static size_t fl_largest(void)
+{
+    mb_free_t *node = tree_root;
+
+    if (node == NULL) {
+        return 0;
+    }
+    while (node->right != NULL) {
+        node = node->right;
+    }
+    return BLOCK_SIZE(node);
+}
+
+#endif
+
+#elif defined(WORST_FIT)
+
+/*
+ * The free blocks are kept in a binary max-heap stored in an array, ordered
+ * by size then by address (the largest block with the lowest address is at
+ * the top). Every block stores its position in the array, so that a block
+ * merged by memory_free can be removed from the middle of the heap in
+ * O(log n). Before a chunk is added, the array is made large enough for
+ * the largest possible number of free blocks in the heap (two free blocks
+ * are never adjacent), and moved to a larger mapping if needed: inserting
+ * a block never fails. If that mapping fails, the chunk is not added.
+ * Only the pages of the array that are actually used get touched.
+ */
+/* Returns true if a must be above b in the heap */
+static int wf_above(mb_free_t *a, mb_free_t *b)
+{
+    return BLOCK_SIZE(a) > BLOCK_SIZE(b) || (BLOCK_SIZE(a) == BLOCK_SIZE(b) && a < b);
+}
+
+static void wf_set(size_t i, mb_free_t *block)
+{
+    wf_heap[i] = block;
+    block->heap_index = i;
+}
+
+static void wf_sift_up(size_t i)
+{
+    mb_free_t *block = wf_heap[i];
+
+    while (i > 0 && wf_above(block, wf_heap[(i - 1) / 2])) {
+        wf_set(i, wf_heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    wf_set(i, block);
+}
+
+static void wf_sift_down(size_t i)
+{
+    mb_free_t *block = wf_heap[i];
+
+    while (2 * i + 1 < wf_heap_size) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < wf_heap_size && wf_above(wf_heap[child + 1], wf_heap[child])) {
+            child++;
+        }
+        if (!wf_above(wf_heap[child], block)) {
+            break;
+        }
+        wf_set(i, wf_heap[child]);
+        i = child;
+    }
+    wf_set(i, block);
+}
+
+static int wf_reserve(size_t size)
+{
+    // One free block every two minimal blocks, one more per chunk, and the one place_aligned splits off before removing any
+    size_t needed = (stats.heap_bytes + size) / (2 * MB_MIN_SIZE) + nb_chunks + 2;
+    size_t capacity = wf_heap_capacity ? wf_heap_capacity : needed;
+
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    if (capacity == wf_heap_capacity) {
+        return 1;
+    }
+    mb_free_t **array = my_mmap(capacity * sizeof(mb_free_t *));
+    if (array == NULL) {
+        return 0;
+    }
+    if (wf_heap != NULL) {
+        memcpy(array, wf_heap, wf_heap_size * sizeof(mb_free_t *));
+        my_munmap(wf_heap, wf_heap_capacity * sizeof(mb_free_t *));
+    }
+    wf_heap = array;
+    wf_heap_capacity = capacity;
+    return 1;
+}
+
+static void fl_insert(mb_free_t *block)
+{
+    // (room reserved by add_chunk)
+    assert(wf_heap_size < wf_heap_capacity);
+    wf_set(wf_heap_size++, block);
+    wf_sift_up(block->heap_index);
+}
+
+static void fl_remove(mb_free_t *block)
+{
+    size_t i = block->heap_index;
+
+    // The last block of the array takes the place of the removed one
+    wf_heap_size--;
+    if (i != wf_heap_size) {
+        mb_free_t *last = wf_heap[wf_heap_size];
+        wf_set(i, last);
+        wf_sift_up(i);
+        wf_sift_down(last->heap_index);
+    }
+}
+
+static mb_free_t *fl_find(size_t size)
+{
+    // The largest block is at the top of the heap
+    if (wf_heap_size == 0 || BLOCK_SIZE(wf_heap[0]) < size) {
+        return NULL;
+    }
+    return wf_heap[0];
+}
+
+static size_t fl_largest(void)
+{
+    return wf_heap_size == 0 ? 0 : BLOCK_SIZE(wf_heap[0]);
+}
+
+#elif defined(TLSF)
+
+/*
+ * Two-Level Segregated Fit. The first level splits the sizes in powers of
+ * two, the second level splits each power of two in TLSF_SL_COUNT ranges
+ * of the same width. Each (first, second) level pair has its own LIFO list
+ * of free blocks, and two levels of bitmaps tell which lists are not empty.
+ * The request is rounded up to the start of the next range, so that any
+ * block of a list at or above that range fits: finding a block only costs
+ * a few bit scans, whatever the number of free blocks.
+ */
+static int tlsf_log2(size_t size)
+{
+    return sizeof(size_t) * 8 - 1 - __builtin_clzl(size);
+}
+
+/* Computes the list of a block size (sizes are never below MB_MIN_SIZE) */
+static void tlsf_mapping(size_t size, int *fl, int *sl)
+{
+    *fl = tlsf_log2(size);
+    *sl = (size >> (*fl - TLSF_SL_LOG2)) - TLSF_SL_COUNT;
+}
+
+static void fl_insert(mb_free_t *block)
+{
+    int fl, sl;
+
+    tlsf_mapping(BLOCK_SIZE(block), &fl, &sl);
+    block->prev = NULL;
+    block->next = tlsf_lists[fl][sl];
+    if (block->next != NULL) block->next->prev = block;
+    tlsf_lists[fl][sl] = block;
+
+    tlsf_fl_bitmap |= 1UL << fl;
+    tlsf_sl_bitmap[fl] |= 1U << sl;
+}
+
+static void fl_remove(mb_free_t *block)
+{
+    int fl, sl;
+
+    tlsf_mapping(BLOCK_SIZE(block), &fl, &sl);
+    if (block->next != NULL) block->next->prev = block->prev;
+    if (block->prev != NULL) block->prev->next = block->next;
+        else tlsf_lists[fl][sl] = block->next;
+
+    if (tlsf_lists[fl][sl] == NULL) {
+        tlsf_sl_bitmap[fl] &= ~(1U << sl);
+        if (tlsf_sl_bitmap[fl] == 0) {
+            tlsf_fl_bitmap &= ~(1UL << fl);
+        }
+    }
+}
+
+static mb_free_t *fl_find(size_t size)
+{
+    int fl, sl;
+    uint32_t sl_map;
+    uint64_t fl_map;
+
+    // Round up to the next range so that every block of the list fits
+    size += (1UL << (tlsf_log2(size) - TLSF_SL_LOG2)) - 1;
+    tlsf_mapping(size, &fl, &sl);
+
+    // Non-empty list in the same power of two ...
+    sl_map = tlsf_sl_bitmap[fl] & (~0U << sl);
+    if (sl_map == 0) {
+        // ... or the first one of a larger power of two
+        fl_map = (fl + 1 < TLSF_FL_COUNT) ? tlsf_fl_bitmap & (~0UL << (fl + 1)) : 0;
+        if (fl_map == 0) {
+            return NULL;
+        }
+        fl = __builtin_ctzl(fl_map);
+        sl_map = tlsf_sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+    return tlsf_lists[fl][sl];
+}
+
+/* The largest block is in the highest non-empty list, whose blocks are not sorted */
+static size_t fl_largest(void)
+{
+    size_t max = 0;
+
+    if (tlsf_fl_bitmap == 0) {
+        return 0;
+    }
+    int fl = tlsf_log2(tlsf_fl_bitmap);
+    int sl = 31 - __builtin_clz(tlsf_sl_bitmap[fl]);
+    for (mb_free_t *current = tlsf_lists[fl][sl]; current != NULL; current = current->next) {
+        if (BLOCK_SIZE(current) > max) {
+            max = BLOCK_SIZE(current);
+        }
+    }
+    return max;
+}
+
+#elif defined(BUDDY)
+
+/*
+ * Binary buddy system: every block has a power-of-two size and is aligned
+ * (relative to the start of its chunk) on its size. The block of order k starting at
+ * offset x has a single buddy, at offset x ^ 2^k: when both are free they
+ * are merged back into their parent block of order k + 1. The free blocks
+ * of each order are kept in a LIFO list, and a bitmap tells which orders
+ * have free blocks.
+ */
+static int buddy_order(size_t size)
+{
+    return sizeof(size_t) * 8 - 1 - __builtin_clzl(size);
+}
+
+static void fl_insert(mb_free_t *block)
+{
+    int order = buddy_order(BLOCK_SIZE(block));
+
+    block->prev = NULL;
+    block->next = buddy_lists[order];
+    if (block->next != NULL) block->next->prev = block;
+    buddy_lists[order] = block;
+    buddy_bitmap |= 1UL << order;
+}
+
+static void fl_remove(mb_free_t *block)
+{
+    int order = buddy_order(BLOCK_SIZE(block));
+
+    if (block->next != NULL) block->next->prev = block->prev;
+    if (block->prev != NULL) block->prev->next = block->next;
+        else buddy_lists[order] = block->next;
+    if (buddy_lists[order] == NULL) {
+        buddy_bitmap &= ~(1UL << order);
+    }
+}
+
+/* Returns a free block of the smallest order >= order, or NULL */
+static mb_free_t *fl_find(int order)
+{
+    uint64_t orders = buddy_bitmap & (~0UL << order);
+
+    if (orders == 0) {
+        return NULL;
+    }
+    return buddy_lists[__builtin_ctzl(orders)];
+}
+
+#elif defined(SEGREGATED_FIT)
+
+/*
+ * Segregated fit: every free block is linked in the list of its size class.
+ * Classes below SF_SMALL_LIMIT hold a single block size, the classes
+ * above cover power-of-two ranges ([256, 512), [512, 1024), ...).
+ * Each class is sorted by size then address, so the first block that
+ * fits is also the one Best Fit would pick, and a bitmap of the
+ * non-empty classes gives the next candidate class without looking at
+ * the empty ones.
+ * The order costs a walk of the class on insertion, also in the exact
+ * classes where all blocks have the same size: it is kept because the SF
+ * traces are checked against the Best Fit ones (mem_shell_sim has no
+ * segregated fit), which take the lowest of the blocks of equal size. A
+ * LIFO class would make the insertion O(1), but the placements would no
+ * longer match.
+ */
+static int sf_class(size_t size)
+{
+    if (size < SF_SMALL_LIMIT) {
+        return size;
+    }
+    int log2 = sizeof(size_t) * 8 - 1 - __builtin_clzl(size);
+    return SF_SMALL_LIMIT + log2 - SF_SMALL_LIMIT_LOG2;
+}
+
+/* Returns the first non-empty class >= c, or -1 */
+static int sf_next_class(int c)
+{
+    int word = c / 64;
+    uint64_t bits;
+
+    if (c >= SF_NB_CLASSES) {
+        return -1;
+    }
+    bits = sf_bitmap[word] & (~0UL << (c % 64));
+    while (bits == 0) {
+        if (++word == SF_BITMAP_WORDS) {
+            return -1;
+        }
+        bits = sf_bitmap[word];
+    }
+    return word * 64 + __builtin_ctzl(bits);
+}
+
+static void fl_insert(mb_free_t *block)
+{
+    int c = sf_class(BLOCK_SIZE(block));
+    mb_free_t *current = sf_classes[c], *prev = NULL;
+
+    // Keep the class sorted by size, then by address (ties go to the lowest address)
+    while (current != NULL && (BLOCK_SIZE(current) < BLOCK_SIZE(block)
+                || (BLOCK_SIZE(current) == BLOCK_SIZE(block) && current < block))) {
+        prev = current;
+        current = current->next;
+    }
+    block->next = current;
+    block->prev = prev;
+    if (current != NULL) current->prev = block;
+    if (prev != NULL) prev->next = block;
+        else sf_classes[c] = block;
+
+    sf_bitmap[c / 64] |= 1UL << (c % 64);
+}
+
+static void fl_remove(mb_free_t *block)
+{
+    int c = sf_class(BLOCK_SIZE(block));
+
+    if (block->next != NULL) block->next->prev = block->prev;
+    if (block->prev != NULL) block->prev->next = block->next;
+        else sf_classes[c] = block->next;
+
+    if (sf_classes[c] == NULL) {
+        sf_bitmap[c / 64] &= ~(1UL << (c % 64));
+    }
+}
+
+/* Finds the smallest free block of at least 'size' bytes */
+static mb_free_t *fl_find(size_t size)
+{
+    int c = sf_next_class(sf_class(size));
+
+    while (c != -1) {
+        mb_free_t *current = sf_classes[c];
+        // Only the range class of 'size' itself may contain blocks too small
+        while (current != NULL && BLOCK_SIZE(current) < size) {
+            current = current->next;
+        }
+        if (current != NULL) {
+            return current;
+        }
+        c = sf_next_class(c + 1);
+    }
+    return NULL;
+}
+
+/* The largest block is the last one of the highest non-empty class */
+static size_t fl_largest(void)
+{
+    int word = SF_BITMAP_WORDS - 1;
+
+    while (sf_bitmap[word] == 0) {
+        if (word-- == 0) {
+            return 0;
+        }
+    }
+    int c = word * 64 + 63 - __builtin_clzl(sf_bitmap[word]);
+    if (c < SF_SMALL_LIMIT) {
+        // (a single block size)
+        return c;
+    }
+    mb_free_t *current = sf_classes[c];
+    while (current->next != NULL) {
+        current = current->next;
+    }
+    return BLOCK_SIZE(current);
+}
+
+#endif
+
+void run_at_exit(void)
+{
+    struct mem_stats s;
+
+    fprintf(stderr,"YEAH B-)\n");
+
+#if defined(MEM_TCACHE)
+    tcache_drain();
+#endif
+    memory_get_stats(&s);
+    fprintf(stderr, "%lu allocations, %lu bytes in %lu free blocks (largest: %lu bytes), %lu bytes of heap, %lu bytes released to the system\n",
+            ULONG(s.nb_allocs), ULONG(s.free_bytes), ULONG(s.nb_free_blocks),
+            ULONG(memory_get_largest_free_block()), ULONG(s.heap_bytes), ULONG(s.released_bytes));
+}
+
+/*
+ * Gives the pages located between start and end, inside a free block, back
+ * to the system with madvise(MADV_DONTNEED): they are no longer resident,
+ * and read as zeros when they are used again. The bytes of the range around
+ * these pages are cleared; the caller makes sure that the rest of the block
+ * is zero, so that the block can be flagged MB_ZERO.
+ * Returns the number of bytes released.
+ */
+static size_t release_range(mb_free_t *block, char *start, char *end)
+{
+    char *first_page = (char *)PAGE_ROUND(start);
+    char *last_page = PAGE_FLOOR(end);
+
+    // (madvise fails on a part of a huge page reserved by MEM_PAGES=HUGETLB)
+    if (first_page >= last_page || madvise(first_page, last_page - first_page, MADV_DONTNEED) != 0) {
+        return 0;
+    }
+    memset(start, 0, first_page - start);
+    memset(last_page, 0, end - last_page);
+    block->size |= MB_ZERO;
+    stats.released_bytes += last_page - first_page;
+    return last_page - first_page;
+}
+
+/* Gives the pages of a whole free block back to the system (see release_range) */
+static size_t release_block(mb_free_t *block)
+{
+    return release_range(block, (char *)block + sizeof(mb_free_t),
+                         (char *)block + BLOCK_SIZE(block) - sizeof(size_t));
+}
+
+#if !defined(BUDDY)
+
+/*
+ * Largest block that memory_free clears when it is merged with blocks
+ * flagged MB_ZERO: the merged block is then flagged MB_ZERO too, so that
+ * the untouched memory at the end of the heap is not lost for calloc
+ * because a block next to it has been freed.
+ */
+#define MEM_ZERO_CLEAR_MAX MEM_PAGE_SIZE
+
+/*
+ * With MEM_TOP, the free block that ends the newest chunk (the untouched
+ * tail of a young heap) is the top block: it is not indexed by the policy.
+ * The requests that no indexed block can hold are cut from its start,
+ * without searching or updating the index, and the blocks freed next to
+ * it merge back into it. The top block is NULL once it has been used up,
+ * and a free block that ends at top_end becomes the top block again.
+ */
+/*
+ * Size of the largest free block (top block included): 'largest' is an
+ * upper bound of it, exact while largest_exact is set. The free blocks are
+ * also counted per power of two, so that removing the largest block lowers
+ * the bound to the end of the highest power of two that still has blocks.
+ * The bound is enough to fail the requests early; the exact size is only
+ * asked for by memory_get_largest_free_block, which reads it from the
+ * index (fl_largest) once the bound is no longer exact.
+ * 'search_limit' is lowered when the policy finds no block for a request,
+ * and raised when a block is freed: a request larger than either of them
+ * fails (or grows the heap) at once, without searching the free blocks.
+ */
+static int size_class(size_t size)
+{
+    return 63 - __builtin_clzll(size);
+}
+
+static void largest_insert(size_t size)
+{
+    int c = size_class(size);
+
+    size_counts[c]++;
+    size_classes |= (uint64_t)1 << c;
+    if (size >= largest) {
+        largest = size;
+        largest_exact = 1;
+    }
+    if (size > search_limit) {
+        search_limit = size;
+    }
+}
+
+static void largest_remove(size_t size)
+{
+    int c = size_class(size);
+
+    if (--size_counts[c] == 0) {
+        size_classes &= ~((uint64_t)1 << c);
+    }
+    if (size == largest) {
+        largest_exact = 0;
+    }
+    size_t limit = size_classes == 0 ? 0 : ((size_t)2 << size_class(size_classes)) - 1;
+    if (limit < largest) {
+        largest = limit;
+        largest_exact = limit == 0;
+    }
+}
+
+/* Indexes a free block (header written), or makes it the top block */
+static void free_insert(mb_free_t *block)
+{
+    largest_insert(BLOCK_SIZE(block));
+#if defined(MEM_TOP)
+    if ((char *)block + BLOCK_SIZE(block) == top_end) {
+        top = block;
+        return;
+    }
+#endif
+    fl_insert(block);
+}
+
+static void free_remove(mb_free_t *block)
+{
+    largest_remove(BLOCK_SIZE(block));
+    if (block == top) {
+        top = NULL;
+        return;
+    }
+    fl_remove(block);
+}
+
+/*
+ * Writes the header and the footer of a free block, and tells the
+ * following block that its predecessor is free.
+ * 'flags' is a combination of MB_LAST and MB_ZERO.
+ */
+static void make_free(mb_free_t *block, size_t size, size_t flags)
+{
+    block->size = size | MB_FREE | flags;
+    *FOOTER(block, size) = size;
+    if (!(flags & MB_LAST)) {
+        SET_PREV_FREE(NEXT_BLOCK(block));
+    }
+}
+
+/*
+ * Turns the free block into an allocated block of block_size bytes.
+ * The remainder is split off as a new free block if it is large enough
+ * to hold the free block metadata.
+ */
+static mb_allocated_t *place(mb_free_t *block, size_t block_size)
+{
+    size_t size = BLOCK_SIZE(block);
+    size_t last = block->size & MB_LAST;
+    size_t prev_free = block->size & MB_PREV_FREE;
+    size_t zero = block->size & MB_ZERO;
+#if defined(NEXT_FIT)
+    // (the next search does not start from the top block, which is not in the list)
+    mb_free_t *following = block == top ? next_fit_ptr : block->next;
+#endif
+
+    free_remove(block);
+    stats.free_bytes -= size;
+
+    if (size - block_size >= MB_MIN_SIZE) {
+        // Create a new free block after the allocated block
+        mb_free_t *new_free_block = (mb_free_t *)((char *)block + block_size);
+        make_free(new_free_block, size - block_size, last | zero);
+        free_insert(new_free_block);
+        stats.free_bytes += size - block_size;
+        last = 0;
+#if defined(NEXT_FIT)
+        if (new_free_block != top) {
+            following = new_free_block;
+        }
+#endif
+    } else {
+        // Not enough space for a new free block
+        block_size = size;
+        stats.nb_free_blocks--;
+        if (!last) {
+            CLEAR_PREV_FREE(NEXT_BLOCK(block));
+        }
+    }
+#if defined(NEXT_FIT)
+    // The next search starts from what is left of the block, or from the following free block
+    next_fit_ptr = following;
+#endif
+
+    // The block was free, so its predecessor is only free if the block was split off for an aligned request
+    mb_allocated_t *allocated_block = (mb_allocated_t *)block;
+    allocated_block->size = block_size | last | prev_free;
+    return allocated_block;
+}
+
+/* Size of the block needed for a request of 'size' bytes */
+static size_t request_block_size(size_t size)
+{
+    // A block must be able to hold the free block metadata once released
+    size_t block_size = MB_ALIGN(size + MB_HEADER_SIZE);
+    return block_size < MB_MIN_SIZE ? MB_MIN_SIZE : block_size;
+}
+
+#if defined(MEM_QUICK)
+/*
+ * Quick lists (deferred coalescing): a freed block of at most
+ * QUICK_MAX_SIZE bytes is not merged with its neighbours, it is pushed on
+ * the LIFO list of its size and stays marked as allocated. A request of
+ * the same block size pops it back without searching the free blocks.
+ * The quick lists are flushed into the free blocks (merging their blocks)
+ * when no free block can hold a request, when they hold more than
+ * QUICK_MAX_BYTES, and by memory_trim. Their blocks count as free blocks
+ * in the stats.
+ */
+#define QUICK_MAX_BYTES 65536
+
+/* Next block of a quick list, stored in the payload */
+#define QUICK_NEXT(b) (*(mb_allocated_t **)PAYLOAD(b))
+
+static void free_block(mb_free_t *block);
+
+/* Gives the blocks of the quick lists to free_block, returns 0 if there was none */
+static int quick_flush(void)
+{
+    if (quick_bytes == 0) {
+        return 0;
+    }
+    for (size_t size = 0; size <= QUICK_MAX_SIZE; size++) {
+        while (quick[size] != NULL) {
+            mb_allocated_t *block = quick[size];
+            quick[size] = QUICK_NEXT(block);
+            // (counted again by free_block)
+            stats.nb_free_blocks--;
+            stats.free_bytes -= size;
+            free_block((mb_free_t *)block);
+        }
+    }
+    quick_bytes = 0;
+    return 1;
+}
+
+static void quick_push(mb_allocated_t *block)
+{
+    size_t size = BLOCK_SIZE(block);
+
+    QUICK_NEXT(block) = quick[size];
+    quick[size] = block;
+    quick_bytes += size;
+    stats.nb_free_blocks++;
+    stats.free_bytes += size;
+    if (quick_bytes > QUICK_MAX_BYTES) {
+        quick_flush();
+    }
+}
+
+/* Block of block_size bytes taken from its quick list, or NULL */
+static mb_allocated_t *quick_pop(size_t block_size)
+{
+    mb_allocated_t *block = block_size <= QUICK_MAX_SIZE ? quick[block_size] : NULL;
+
+    if (block != NULL) {
+        quick[block_size] = QUICK_NEXT(block);
+        quick_bytes -= block_size;
+        stats.nb_free_blocks--;
+        stats.free_bytes -= block_size;
+    }
+    return block;
+}
+#endif
+
+/* Returns a free block of at least block_size bytes (growing the heap with MEM_GROW), or NULL */
+static mb_free_t *find_block(size_t block_size)
+{
+    mb_free_t *block = NULL;
+
+    if (block_size <= largest && block_size <= search_limit) {
+        block = fl_find(block_size);
+        if (block == NULL && top != NULL && BLOCK_SIZE(top) >= block_size) {
+            block = top;
+        }
+        if (block == NULL) {
+            // The same request, or a larger one, would not find a block either until a block is freed
+            search_limit = block_size - 1;
+        }
+    }
+#if defined(MEM_QUICK)
+    // The blocks of the quick lists, once merged, may hold the request
+    if (block == NULL && quick_flush()) {
+        return find_block(block_size);
+    }
+#endif
+#if defined(MEM_GROW)
+    if (block == NULL) {
+        // Map a new chunk: it becomes a single free block, and the top block if there is one
+        size_t chunk_size = grow_size(block_size);
+        block = add_chunk(chunk_size);
+        if (block != NULL) {
+            if (top != NULL) {
+                fl_insert(top);
+                top = NULL;
+            }
+            top_end = (char *)block + chunk_size;
+            make_free(block, chunk_size, MB_LAST | MB_ZERO);
+            free_insert(block);
+            stats.nb_free_blocks++;
+            stats.free_bytes += chunk_size;
+        }
+    }
+#endif
+    return block;
+}
+
+/*
+ * Takes a block of the heap for 'size' bytes, without tracing nor counting
+ * the allocation (see heap_alloc). If 'zero' is not NULL, it tells whether
+ * the payload only contains zeros. Returns NULL if no block is found.
+ */
+static mb_allocated_t *heap_take(size_t size, int *zero)
+{
+    size_t block_size = request_block_size(size);
+#if defined(MEM_QUICK)
+    mb_allocated_t *cached = quick_pop(block_size);
+    if (cached != NULL) {
+        if (zero != NULL) {
+            *zero = 0;
+        }
+        return cached;
+    }
+#endif
+    mb_free_t *block = find_block(block_size);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    int was_zero = (block->size & MB_ZERO) != 0;
+    mb_allocated_t *allocated_block = place(block, block_size);
+    if (zero != NULL) {
+        // Clear what the metadata of the free block left in the payload
+        if (was_zero) {
+            if (sizeof(mb_free_t) > MB_HEADER_SIZE) {
+                memset(PAYLOAD(allocated_block), 0, sizeof(mb_free_t) - MB_HEADER_SIZE);
+            }
+            *FOOTER(allocated_block, BLOCK_SIZE(allocated_block)) = 0;
+        }
+        *zero = was_zero;
+    }
+    return allocated_block;
+}
+
+/*
+ * The block is taken from a free block large enough to hold the request
+ * and the worst padding. The byte 'offset' of the block (MB_HEADER_SIZE to
+ * align the payload, 0 to align the header itself) lands on a multiple of
+ * 'alignment'. The space located before the aligned block is split off as
+ * a free block (the block is moved by 'alignment' until that space is
+ * either empty or large enough), so that it can be reused.
+ * Returns the allocated block, or NULL.
+ */
+static mb_allocated_t *place_aligned(size_t alignment, size_t offset, size_t block_size)
+{
+    mb_free_t *block = find_block(block_size + MB_MIN_SIZE + alignment);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    char *aligned = (char *)ALIGN_UP((char *)block + offset, alignment) - offset;
+    size_t padding = aligned - (char *)block;
+    if (padding != 0 && padding < MB_MIN_SIZE) {
+        aligned += ALIGN_UP(MB_MIN_SIZE - padding, alignment);
+        padding = aligned - (char *)block;
+    }
+
+    if (padding != 0) {
+        // The padding becomes a free block, followed by the free block the request is taken from
+        mb_free_t *aligned_block = (mb_free_t *)aligned;
+        free_remove(block);
+        make_free(aligned_block, BLOCK_SIZE(block) - padding, block->size & (MB_LAST | MB_ZERO));
+        make_free(block, padding, block->size & MB_ZERO);
+        free_insert(block);
+        free_insert(aligned_block);
+        stats.nb_free_blocks++;
+        block = aligned_block;
+    }
+    return place(block, block_size);
+}
+
+static void *arena_alloc_aligned(size_t alignment, size_t size)
+{
+    // Check for invalid size
+    if (size == 0) {
+        return NULL; // Cannot allocate zero bytes
+    }
+    if (alignment <= MEM_ALIGNMENT) {
+        return arena_alloc(size);
+    }
+#if defined(MEM_MMAP_THRESHOLD)
+    if (size >= MEM_MMAP_THRESHOLD) {
+        return mapped_alloc(size, alignment);
+    }
+#endif
+
+    mb_allocated_t *allocated_block = place_aligned(alignment, MB_HEADER_SIZE, request_block_size(size));
+    if (allocated_block == NULL) {
+        print_alloc_error(size);
+        return NULL;
+    }
+    count_alloc(size, BLOCK_SIZE(allocated_block));
+
+    print_alloc_info(PAYLOAD(allocated_block), size);
+    return PAYLOAD(allocated_block);
+}
+
+static void arena_init(void)
+{
+    /* Use my_mmap_pool to allocate the memory region (MEM_POOL_SIZE bytes) */
+    mb_free_t *block = add_chunk(MEM_POOL_SIZE);
+    if (block == NULL) {
+        return;
+    }
+
+    // The whole region is a single free block
+    first_free = NULL;
+    largest_exact = 1;
+    search_limit = (size_t)-1;
+    top_end = (char *)block + MEM_POOL_SIZE;
+    make_free(block, MEM_POOL_SIZE, MB_LAST | MB_ZERO);
+    free_insert(block);
+    stats.nb_free_blocks = 1;
+    stats.free_bytes = MEM_POOL_SIZE;
+}
+
+/* Gives an allocated block back to the free blocks, merged with its free neighbours */
+static void free_block(mb_free_t *block)
+{
+    mb_free_t *freed = block;
+    size_t freed_size = BLOCK_SIZE(block);
+    size_t size = freed_size;
+    size_t last = block->size & MB_LAST;
+    mb_free_t *prev = NULL, *next = NULL;
+    // The merged block is known to be zero if all its free neighbours are
+    size_t zero = MB_ZERO, prev_zero = 0, next_zero = 0;
+
+    stats.free_bytes += size;
+    stats.nb_free_blocks++;
+
+    // Merge with the previous block, found through its footer
+    if (block->size & MB_PREV_FREE) {
+        prev = PREV_BLOCK(block);
+        free_remove(prev);
+        prev_zero = prev->size & MB_ZERO;
+        zero &= prev_zero;
+        size += BLOCK_SIZE(prev);
+        block = prev;
+        stats.nb_free_blocks--;
+    }
+
+    // Merge with the next block, found through the size of the block
+    if (!last) {
+        mb_free_t *following = (mb_free_t *)((char *)block + size);
+        if (following->size & MB_FREE) {
+            next = following;
+            free_remove(next);
+            next_zero = next->size & MB_ZERO;
+            zero &= next_zero;
+            last = next->size & MB_LAST;
+            size += BLOCK_SIZE(next);
+            stats.nb_free_blocks--;
+        }
+    }
+
+    // A small block merged with zero blocks is cleared, with the metadata it makes useless
+    if (zero && (prev != NULL || next != NULL) && freed_size <= MEM_ZERO_CLEAR_MAX) {
+        memset(freed, 0, freed_size);
+        if (prev != NULL) {
+            *((size_t *)freed - 1) = 0;
+        }
+        if (next != NULL) {
+            memset(next, 0, sizeof(mb_free_t));
+        }
+    } else {
+        zero = 0;
+    }
+
+    make_free(block, size, last | zero);
+    free_insert(block);
+
+#if defined(MEM_TRIM_THRESHOLD)
+    // A large free block gives its pages back to the system, except those of the neighbours already given back
+    if (!zero && size >= MEM_TRIM_THRESHOLD) {
+        char *start = prev_zero ? (char *)freed - sizeof(size_t) : (char *)block + sizeof(mb_free_t);
+        char *end = next_zero ? (char *)next + sizeof(mb_free_t) : (char *)block + size - sizeof(size_t);
+        release_range(block, start, end);
+    }
+#endif
+
+#if defined(NEXT_FIT)
+    // A block merged with the start of the next search becomes the new start (the top block cannot be)
+    if ((char *)next_fit_ptr >= (char *)block && (char *)next_fit_ptr < (char *)block + size) {
+        next_fit_ptr = block == top ? NULL : block;
+    }
+#endif
+}
+
+#if defined(MEM_SLAB)
+/*
+ * Requests of at most SLAB_MAX_SIZE bytes are served by slabs. A slab is
+ * a page taken from the heap: a block of exactly one page whose header is
+ * aligned on the page (the header is the start of the slab), so that the
+ * free block left after a slab is aligned in turn and the next slab takes
+ * the next page. The rest of the page is cut into slots of a single size
+ * class. The objects have no header:
+ * a bitmap in the slab tells which slots are free, and the slab_pages map
+ * of each chunk tells which pages are slabs, so that memory_free knows its
+ * objects from the blocks of the heap. The slabs with a free slot are
+ * linked per class. A slab that becomes empty goes back to the heap,
+ * unless it is the only one left in its class (so that allocating and
+ * freeing a single object does not take and release a page each time).
+ */
+struct slab {
+    char header[MB_HEADER_SIZE];    /* header of the block of the slab, owned by the heap */
+    struct slab *next, *prev;   /* slabs of the class with a free slot */
+    size_t slot_size;
+    size_t nb_free;
+    uint64_t free_slots[MEM_PAGE_SIZE / SLAB_GRANULE / 64];    /* bit set: free slot */
+};
+
+/* First slot of a slab, and number of slots of a slab of the given slot size */
+#define SLAB_SLOTS(s) ((char *)(s) + ALIGN_UP(sizeof(struct slab), SLAB_GRANULE))
+#define SLAB_NB_SLOTS(slot_size) ((MEM_PAGE_SIZE - ALIGN_UP(sizeof(struct slab), SLAB_GRANULE)) / (slot_size))
+
+/* Chunk and bit of the slab map for the page holding p, returns 0 if p is not in the heap */
+static int slab_bit(void *p, struct mem_chunk **chunk, size_t *bit)
+{
+    *chunk = chunk_of(p);
+    if (*chunk == NULL) {
+        return 0;
+    }
+    *bit = (PAGE_FLOOR(p) - PAGE_FLOOR((*chunk)->start)) / MEM_PAGE_SIZE;
+    return 1;
+}
+
+/* Slab holding the object p, or NULL if p is a block of the heap or a mapped block */
+static struct slab *slab_of(void *p)
+{
+    struct mem_chunk *chunk;
+    size_t bit;
+
+    if (slab_bit(p, &chunk, &bit) && (chunk->slab_pages[bit / 8] & (1 << bit % 8))) {
+        return (struct slab *)PAGE_FLOOR(p);
+    }
+    return NULL;
+}
+
+static void slab_link(struct slab **head, struct slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head != NULL) {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+static void slab_unlink(struct slab **head, struct slab *slab)
+{
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        *head = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/* Takes a page from the heap and cuts it into slots of slot_size bytes, returns NULL if the heap is full */
+static struct slab *slab_new(size_t slot_size)
+{
+    mb_allocated_t *block = place_aligned(MEM_PAGE_SIZE, 0, MEM_PAGE_SIZE);
+    struct mem_chunk *chunk;
+    size_t bit, nb_slots = SLAB_NB_SLOTS(slot_size);
+
+    if (block == NULL) {
+        return NULL;
+    }
+    struct slab *slab = (struct slab *)block;
+    slab_bit(slab, &chunk, &bit);
+    chunk->slab_pages[bit / 8] |= 1 << bit % 8;
+
+    slab->slot_size = slot_size;
+    slab->nb_free = nb_slots;
+    for (size_t w = 0; w < sizeof(slab->free_slots) / sizeof(uint64_t); w++) {
+        slab->free_slots[w] = nb_slots >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << nb_slots) - 1;
+        nb_slots -= nb_slots >= 64 ? 64 : nb_slots;
+    }
+    return slab;
+}
+
+/* Allocates a slot for 'size' bytes (at most SLAB_MAX_SIZE), returns NULL if no slab can be made */
+static void *slab_alloc(size_t size)
+{
+    int c = (size - 1) / SLAB_GRANULE;
+    struct slab *slab = slabs[c];
+    int w = 0;
+
+    if (slab == NULL) {
+        slab = slab_new((c + 1) * SLAB_GRANULE);
+        if (slab == NULL) {
+            return NULL;
+        }
+        slab_link(&slabs[c], slab);
+    }
+    while (slab->free_slots[w] == 0) {
+        w++;
+    }
+    int slot = w * 64 + __builtin_ctzll(slab->free_slots[w]);
+    slab->free_slots[w] &= slab->free_slots[w] - 1;
+    if (--slab->nb_free == 0) {
+        slab_unlink(&slabs[c], slab);
+    }
+
+    void *p = SLAB_SLOTS(slab) + slot * slab->slot_size;
+    count_alloc(size, slab->slot_size);
+    print_alloc_info(p, size);
+    return p;
+}
+
+static void slab_free(struct slab *slab, void *p)
+{
+    int c = slab->slot_size / SLAB_GRANULE - 1;
+    size_t slot = ((char *)p - SLAB_SLOTS(slab)) / slab->slot_size;
+
+    slab->free_slots[slot / 64] |= (uint64_t)1 << slot % 64;
+    if (++slab->nb_free == 1) {
+        slab_link(&slabs[c], slab);
+    } else if (slab->nb_free == SLAB_NB_SLOTS(slab->slot_size) && (slab->prev != NULL || slab->next != NULL)) {
+        // The empty slab goes back to the heap
+        struct mem_chunk *chunk;
+        size_t bit;
+
+        slab_unlink(&slabs[c], slab);
+        slab_bit(slab, &chunk, &bit);
+        chunk->slab_pages[bit / 8] &= ~(1 << bit % 8);
+        free_block((mb_free_t *)slab);
+    }
+}
+#endif
+
+/* Frees the block of p, held by the current arena (or mapped) */
+static void arena_free(void *p)
+{
+#if defined(MEM_SLAB)
+    struct slab *slab = slab_of(p);
+    if (slab != NULL) {
+        slab_free(slab, p);
+        return;
+    }
+#endif
+
+    // The metadata of the block to free is immediately before the allocated block
+    mb_free_t *block = (mb_free_t *)HEADER(p);
+#if defined(MEM_MAPPED_BLOCKS)
+    if (block->size & MB_MAPPED) {
+        mapped_free((mb_allocated_t *)block);
+        return;
+    }
+#endif
+#if defined(MEM_QUICK)
+    if (BLOCK_SIZE(block) <= QUICK_MAX_SIZE) {
+        quick_push((mb_allocated_t *)block);
+        return;
+    }
+#endif
+    free_block(block);
+}
+
+/*
+ * Resizes an allocated block without moving it: the block grows into the
+ * following block if that one is free and large enough, and gives its tail
+ * back to the free blocks if what it no longer needs can hold a free block.
+ * Returns 0 if the block cannot hold the new size.
+ */
+static int resize_in_place(mb_allocated_t *block, size_t size)
+{
+    size_t block_size = request_block_size(size);
+    size_t old_size = BLOCK_SIZE(block);
+    size_t flags = block->size & (MB_PREV_FREE | MB_LAST);
+
+    // Absorb the following block
+    if (block_size > old_size && !(flags & MB_LAST)) {
+        mb_free_t *next = NEXT_BLOCK(block);
+        if ((next->size & MB_FREE) && old_size + BLOCK_SIZE(next) >= block_size) {
+#if defined(NEXT_FIT)
+            if (next_fit_ptr == next) {
+                next_fit_ptr = next->next;
+            }
+#endif
+            free_remove(next);
+            stats.free_bytes -= BLOCK_SIZE(next);
+            stats.nb_free_blocks--;
+            old_size += BLOCK_SIZE(next);
+            flags = (flags & MB_PREV_FREE) | (next->size & MB_LAST);
+            block->size = old_size | flags;
+            if (!(flags & MB_LAST)) {
+                CLEAR_PREV_FREE(NEXT_BLOCK(block));
+            }
+        }
+    }
+    if (block_size > old_size) {
+        return 0;
+    }
+
+    // Free the tail, merged with the following block if that one is free
+    if (old_size - block_size >= MB_MIN_SIZE) {
+        mb_free_t *tail = (mb_free_t *)((char *)block + block_size);
+        tail->size = (old_size - block_size) | (flags & MB_LAST);
+        block->size = block_size | (flags & MB_PREV_FREE);
+        free_block(tail);
+    }
+    return 1;
+}
+
+static size_t arena_largest_free_block(void)
+{
+    if (!largest_exact) {
+        // Only a bound is known: the index gives the exact size (the top block is not indexed)
+        largest = fl_largest();
+        if (top != NULL && BLOCK_SIZE(top) > largest) {
+            largest = BLOCK_SIZE(top);
+        }
+        largest_exact = 1;
+    }
+    return largest;
+}
+
+#else /* BUDDY */
+
+/* Cuts a chunk in free blocks of decreasing power-of-two sizes, each one aligned on its size */
+static void buddy_add_chunk(void *start, size_t chunk_size)
+{
+    size_t offset = 0;
+
+    while (offset < chunk_size
+           && (1UL << buddy_order(chunk_size - offset)) >= sizeof(mb_free_t)) {
+        size_t size = 1UL << buddy_order(chunk_size - offset);
+        mb_free_t *block = (mb_free_t *)((char *)start + offset);
+        block->size = size | MB_FREE | MB_ZERO;
+        fl_insert(block);
+        stats.nb_free_blocks++;
+        stats.free_bytes += size;
+        offset += size;
+    }
+}
+
+/*
+ * Splits a block in halves until it is not larger than needed for
+ * block_size bytes: the upper halves become free (flagged with 'zero',
+ * 0 or MB_ZERO). Returns the new size.
+ */
+static size_t buddy_split(mb_free_t *block, size_t block_size, size_t zero)
+{
+    size_t current_size = BLOCK_SIZE(block);
+
+    while (current_size / 2 >= block_size) {
+        current_size /= 2;
+        mb_free_t *buddy = (mb_free_t *)((char *)block + current_size);
+        buddy->size = current_size | MB_FREE | zero;
+        fl_insert(buddy);
+        stats.nb_free_blocks++;
+        stats.free_bytes += current_size;
+    }
+    return current_size;
+}
+
+/*
+ * Takes a block of the heap for 'size' bytes, without tracing nor counting
+ * the allocation (see heap_alloc). If 'zero' is not NULL, it tells whether
+ * the payload only contains zeros. Returns NULL if no block is found.
+ */
+static mb_allocated_t *heap_take(size_t size, int *zero)
+{
+    // Smallest power of two that holds the request and the free block metadata
+    size_t block_size = size + MB_HEADER_SIZE;
+    if (block_size < sizeof(mb_free_t)) {
+        block_size = sizeof(mb_free_t);
+    }
+    int order = buddy_order(block_size);
+    if (block_size != (1UL << order)) {
+        order++;
+    }
+
+    mb_free_t *block = (order < BUDDY_NB_ORDERS) ? fl_find(order) : NULL;
+#if defined(MEM_GROW)
+    if (block == NULL && order < BUDDY_NB_ORDERS - 1) {
+        // Map a new chunk and cut it in blocks
+        size_t chunk_size = grow_size(1UL << order);
+        void *start = add_chunk(chunk_size);
+        if (start != NULL) {
+            buddy_add_chunk(start, chunk_size);
+            block = fl_find(order);
+        }
+    }
+#endif
+    if (block == NULL) {
+        return NULL;
+    }
+    fl_remove(block);
+    stats.nb_free_blocks--;
+
+    // Split the block in halves until it has the right order: the upper halves become free
+    size_t was_zero = block->size & MB_ZERO;
+    stats.free_bytes -= BLOCK_SIZE(block);
+    size_t current_size = buddy_split(block, 1UL << order, was_zero);
+
+    mb_allocated_t *allocated_block = (mb_allocated_t *)block;
+    allocated_block->size = current_size;
+    if (zero != NULL) {
+        // Clear what the metadata of the free block left in the payload
+        if (was_zero && sizeof(mb_free_t) > MB_HEADER_SIZE) {
+            memset(PAYLOAD(allocated_block), 0, sizeof(mb_free_t) - MB_HEADER_SIZE);
+        }
+        *zero = was_zero != 0;
+    }
+    return allocated_block;
+}
+
+/*
+ * A block is aligned on its size (when it is not larger than a page), and
+ * its payload on the size of the header. A payload with a larger alignment
+ * could not start a block: such requests get their own mapping instead.
+ */
+static void *arena_alloc_aligned(size_t alignment, size_t size)
+{
+    if (alignment <= MB_HEADER_SIZE) {
+        return arena_alloc(size);
+    }
+    if (size == 0) {
+        return NULL; // Cannot allocate zero bytes
+    }
+    return mapped_alloc(size, alignment);
+}
+
+static void arena_init(void)
+{
+    /* Use my_mmap_pool to allocate the memory region (MEM_POOL_SIZE bytes) */
+    void *start = add_chunk(MEM_POOL_SIZE);
+    if (start != NULL) {
+        buddy_add_chunk(start, MEM_POOL_SIZE);
+    }
+}
+
+/* Frees the block of p, held by the current arena (or mapped) */
+static void arena_free(void *p)
+{
+    mb_free_t *block = (mb_free_t *)HEADER(p);
+    if (block->size & MB_MAPPED) {
+        mapped_free((mb_allocated_t *)block);
+        return;
+    }
+    size_t size = BLOCK_SIZE(block);
+    struct mem_chunk *chunk = chunk_of(block);
+
+    stats.free_bytes += size;
+    stats.nb_free_blocks++;
+
+    // Merge with the buddy as long as it is free and has not been split
+    while (1) {
+        size_t buddy_offset = ((char *)block - (char *)chunk->start) ^ size;
+        mb_free_t *buddy = (mb_free_t *)((char *)chunk->start + buddy_offset);
+
+        if (buddy_offset + size > chunk->size || (buddy->size & ~MB_ZERO) != (size | MB_FREE)) {
+            break;
+        }
+        fl_remove(buddy);
+        stats.nb_free_blocks--;
+        if (buddy < block) {
+            block = buddy;
+        }
+        size *= 2;
+    }
+
+    block->size = size | MB_FREE;
+    fl_insert(block);
+
+#if defined(MEM_TRIM_THRESHOLD)
+    // A large free block gives its pages back to the system
+    if (size >= MEM_TRIM_THRESHOLD) {
+        release_block(block);
+    }
+#endif
+}
+
+/*
+ * Resizes an allocated block without moving it: a block can only shrink,
+ * by giving its upper halves back. Their buddies are the lower halves,
+ * which stay allocated, so they are not merged.
+ * Returns 0 if the block cannot hold the new size.
+ */
+static int resize_in_place(mb_allocated_t *block, size_t size)
+{
+    size_t block_size = size + MB_HEADER_SIZE;
+
+    if (block_size < sizeof(mb_free_t)) {
+        block_size = sizeof(mb_free_t);
+    }
+    if (block_size > BLOCK_SIZE(block)) {
+        return 0;
+    }
+    block->size = buddy_split((mb_free_t *)block, block_size, 0);
+    return 1;
+}
+
+/* The free blocks of the highest order in the bitmap are the largest ones */
+static size_t arena_largest_free_block(void)
+{
+    return buddy_bitmap == 0 ? 0 : (size_t)1 << buddy_order(buddy_bitmap);
+}
+
+#endif /* BUDDY */
+
+/*
+ * Allocates a block of the heap for 'size' bytes. If 'zero' is not NULL,
+ * it tells whether the payload only contains zeros.
+ */
+static void *heap_alloc(size_t size, int *zero)
+{
+    mb_allocated_t *allocated_block = heap_take(size, zero);
+    if (allocated_block == NULL) {
+        // No suitable block found, print an error message and return NULL
+        print_alloc_error(size);
+        return NULL;
+    }
+    count_alloc(size, BLOCK_SIZE(allocated_block));
+
+    // Call print_alloc_info to print allocation information
+    print_alloc_info(PAYLOAD(allocated_block), size);
+
+    return PAYLOAD(allocated_block); // Return a pointer immediately after metadata
+}
+
+#if defined(MEM_TCACHE)
+/*
+ * Thread caches: each thread keeps the blocks of at most TCACHE_MAX_SIZE
+ * bytes it frees on a LIFO list per size class, and allocates from these
+ * lists without taking any lock. Class c holds blocks of at least
+ * c * TCACHE_GRANULE bytes; a request takes a block from the class of
+ * its block size rounded up. The cached blocks stay allocated for their
+ * arena (they are not in the stats of the free blocks, and their reuse
+ * is not counted as an allocation).
+ * An empty class is refilled with TCACHE_BATCH blocks of the arena of the
+ * thread, taken under a single lock. A class holds at most TCACHE_COUNT
+ * blocks: beyond that, its oldest TCACHE_BATCH blocks go back to their
+ * arenas, so a cache holds at most about 66KB. The cache of a thread is
+ * drained when the thread exits, and when its arena cannot serve a request
+ * (the cached blocks, once merged, may hold it).
+ */
+#define TCACHE_MAX_SIZE 512
+#define TCACHE_GRANULE (MEM_ALIGNMENT > 16 ? MEM_ALIGNMENT : 16)
+#define TCACHE_NB_CLASSES (TCACHE_MAX_SIZE / TCACHE_GRANULE + 1)
+#define TCACHE_COUNT 8
+#define TCACHE_BATCH 4
+
+struct tcache {
+    mb_allocated_t *blocks[TCACHE_NB_CLASSES];
+    unsigned count[TCACHE_NB_CLASSES];
+    int registered;     /* the cache is drained at thread exit */
+    int disabled;       /* the cache has been drained at thread exit, it is no longer used */
+};
+
+static __thread struct tcache tcache __attribute__((tls_model("initial-exec")));
+
+/* Next block of a cache list, stored in the payload */
+#define TCACHE_NEXT(b) (*(mb_allocated_t **)PAYLOAD(b))
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+/* Frees the blocks of the list, each one in its arena (the blocks of an arena that follow each other are freed under a single lock, the ones of another arena go to its remote frees with MEM_REMOTE) */
+static void tcache_flush(mb_allocated_t *list)
+{
+    while (list != NULL) {
+#if defined(MEM_REMOTE)
+        mb_allocated_t *block = list;
+        list = TCACHE_NEXT(block);
+        if (remote_free(PAYLOAD(block))) {
+            continue;
+        }
+        list = block;
+#endif
+        arena_lock_owner(PAYLOAD(list));
+        do {
+            mb_allocated_t *next = TCACHE_NEXT(list);
+            arena_free(PAYLOAD(list));
+            list = next;
+        } while (list != NULL && chunk_of(list) != NULL);
+        arena_unlock();
+    }
+}
+
+#if defined(MEM_PCPU)
+/*
+ * Per-CPU caches: when the threads run restartable sequences (rseq), the
+ * cached blocks are kept per CPU rather than per thread, so that their
+ * number is bound by the number of CPUs rather than by the number of
+ * threads. Each CPU has an array of at most TCACHE_COUNT blocks per class.
+ * A thread takes a block from (or puts a block in) the array of the CPU it
+ * runs on with a restartable sequence: a few instructions that read the
+ * number of the CPU, then update its array, the last one storing the new
+ * count. If the thread is preempted, migrated or interrupted by a signal
+ * before that store, the kernel restarts the sequence from its start: the
+ * array of a CPU is only updated by the thread that runs on it, without
+ * atomic instructions.
+ * glibc registers each thread with rseq; the threads it could not register
+ * (kernel without rseq, GLIBC_TUNABLES=glibc.pthread.rseq=0) use the thread
+ * caches instead. A full array sends the block back to its arena, and an
+ * empty one is refilled with TCACHE_BATCH blocks. The caches of the CPUs
+ * outlive the threads: tcache_drain only drains the one of the CPU of the
+ * calling thread.
+ */
+struct pcpu_list {
+    size_t count;
+    mb_allocated_t *blocks[TCACHE_COUNT];
+};
+
+struct pcpu_cache {
+    struct pcpu_list lists[TCACHE_NB_CLASSES];
+} __attribute__((aligned(64)));
+
+/* Caches of the CPUs (mapped by memory_init if rseq is available), and their number */
+static struct pcpu_cache *pcpu_caches;
+static unsigned pcpu_nb_cpus;
+
+/* rseq area glibc registered for the calling thread */
+#define RSEQ_AREA() ((struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset))
+
+/* The calling thread uses the per-CPU caches (its cpu_id is negative if glibc could not register it) */
+#define PCPU_ACTIVE() (pcpu_caches != NULL && (int)RSEQ_AREA()->cpu_id >= 0)
+
+/*
+ * Start of a restartable sequence: its descriptor (3), the store of the
+ * descriptor in the rseq area (6), and the start of the sequence (1). The
+ * sequence ends at 2 (just after its last store), and restarts from 6 when
+ * it is aborted (4, preceded by the signature that the kernel checks).
+ */
+#define PCPU_RSEQ_START                                     \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                    \
+    ".balign 32\n\t"                                        \
+    "3:\n\t"                                                \
+    ".long 0, 0\n\t"                                        \
+    ".quad 1f, 2f - 1f, 4f\n\t"                              \
+    ".popsection\n\t"                                       \
+    "6:\n\t"                                                \
+    "leaq 3b(%%rip), %[list]\n\t"                           \
+    "movq %[list], %c[cs](%[rs])\n\t"                       \
+    "1:\n\t"
+
+#define PCPU_RSEQ_ABORT                                     \
+    ".pushsection __rseq_failure, \"ax\"\n\t"               \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                             \
+    ".long 0x53053053\n\t"                                  \
+    "4:\n\t"                                                \
+    "jmp 6b\n\t"                                            \
+    ".popsection\n\t"
+
+/* Address of the list of class c of the CPU: 'list' is the number of the CPU, jumps to 5 if it has no cache */
+#define PCPU_RSEQ_LIST                                      \
+    "movl %c[cpu](%[rs]), %k[list]\n\t"                     \
+    "cmpl %[nb], %k[list]\n\t"                              \
+    "jae 5f\n\t"                                            \
+    "imulq %[stride], %[list], %[list]\n\t"                 \
+    "addq %[list0], %[list]\n\t"
+
+#define PCPU_RSEQ_INPUTS                                    \
+    [rs] "r"(RSEQ_AREA()), [list0] "r"(&pcpu_caches[0].lists[c]), [nb] "r"(pcpu_nb_cpus),   \
+    [stride] "i"(sizeof(struct pcpu_cache)), [cs] "i"(offsetof(struct rseq, rseq_cs)),      \
+    [cpu] "i"(offsetof(struct rseq, cpu_id))
+
+/* Takes a block of class c from the cache of the CPU of the calling thread, returns NULL if it has none */
+static mb_allocated_t *pcpu_pop(int c)
+{
+    mb_allocated_t *block;
+    uintptr_t list, count;
+
+    __asm__ __volatile__(
+        PCPU_RSEQ_START
+        "xorl %k[block], %k[block]\n\t"
+        PCPU_RSEQ_LIST
+        "movq (%[list]), %[count]\n\t"
+        "testq %[count], %[count]\n\t"
+        "jz 5f\n\t"
+        "subq $1, %[count]\n\t"
+        "movq 8(%[list], %[count], 8), %[block]\n\t"
+        "movq %[count], (%[list])\n\t"
+        "2:\n\t"
+        "5:\n\t"
+        PCPU_RSEQ_ABORT
+        : [block] "=&r"(block), [list] "=&r"(list), [count] "=&r"(count)
+        : PCPU_RSEQ_INPUTS
+        : "memory", "cc");
+    return block;
+}
+
+/* Puts the block in the cache of class c of the CPU of the calling thread, returns 0 if it is full */
+static int pcpu_push(int c, mb_allocated_t *block)
+{
+    uintptr_t list, count;
+    int done;
+
+    __asm__ __volatile__(
+        PCPU_RSEQ_START
+        "xorl %[done], %[done]\n\t"
+        PCPU_RSEQ_LIST
+        "movq (%[list]), %[count]\n\t"
+        "cmpq %[max], %[count]\n\t"
+        "jae 5f\n\t"
+        "movq %[block], 8(%[list], %[count], 8)\n\t"
+        "addq $1, %[count]\n\t"
+        "movq %[count], (%[list])\n\t"
+        "2:\n\t"
+        "movl $1, %[done]\n\t"
+        "5:\n\t"
+        PCPU_RSEQ_ABORT
+        : [done] "=&r"(done), [list] "=&r"(list), [count] "=&r"(count)
+        : [block] "r"(block), [max] "i"(TCACHE_COUNT), PCPU_RSEQ_INPUTS
+        : "memory", "cc");
+    return done;
+}
+
+/* Takes a block of class c from the cache of the CPU, refilling it if it is empty, returns NULL if the arena is full */
+static mb_allocated_t *pcpu_get(int c)
+{
+    mb_allocated_t *block = pcpu_pop(c);
+    if (block != NULL) {
+        return block;
+    }
+
+    // (the blocks of the refill are only counted and traced when they are handed out)
+    arena_lock_thread();
+    block = heap_take(c * TCACHE_GRANULE - MB_HEADER_SIZE, NULL);
+    for (int i = 1; block != NULL && i < TCACHE_BATCH; i++) {
+        mb_allocated_t *other = heap_take(c * TCACHE_GRANULE - MB_HEADER_SIZE, NULL);
+        if (other == NULL) {
+            break;
+        }
+        if (!pcpu_push(c, other)) {
+            arena_free(PAYLOAD(other));
+            break;
+        }
+    }
+    arena_unlock();
+    return block;
+}
+
+/* Gives the blocks of the cache of the CPU of the calling thread back to their arenas, returns 0 if there was none */
+static int pcpu_drain(void)
+{
+    mb_allocated_t *list = NULL, *block;
+
+    for (int c = 0; c < TCACHE_NB_CLASSES; c++) {
+        while ((block = pcpu_pop(c)) != NULL) {
+            TCACHE_NEXT(block) = list;
+            list = block;
+        }
+    }
+    tcache_flush(list);
+    return list != NULL;
+}
+#endif
+
+static int tcache_drain(void)
+{
+    int drained = 0;
+
+#if defined(MEM_PCPU)
+    if (PCPU_ACTIVE()) {
+        drained = pcpu_drain();
+    }
+#endif
+    for (int c = 0; c < TCACHE_NB_CLASSES; c++) {
+        if (tcache.blocks[c] != NULL) {
+            tcache_flush(tcache.blocks[c]);
+            tcache.blocks[c] = NULL;
+            tcache.count[c] = 0;
+            drained = 1;
+        }
+    }
+    return drained;
+}
+
+/* Destructor of tcache_key, called when a thread exits */
+static void tcache_exit(void *unused)
+{
+    tcache_drain();
+    tcache.disabled = 1;
+}
+
+static void tcache_key_create(void)
+{
+    pthread_key_create(&tcache_key, tcache_exit);
+}
+
+/* Caches the block of p, returns 0 if it is not cached */
+static int tcache_put(void *p)
+{
+    mb_allocated_t *block = HEADER(p);
+    size_t header = UNLOCKED_SIZE(block);
+    size_t size = MB_SIZE(header);
+
+    if (size > TCACHE_MAX_SIZE || (header & MB_MAPPED) || tcache.disabled) {
+        return 0;
+    }
+#if defined(MEM_PCPU)
+    if (PCPU_ACTIVE()) {
+        return pcpu_push(size / TCACHE_GRANULE, block);
+    }
+#endif
+    if (!tcache.registered) {
+        pthread_once(&tcache_once, tcache_key_create);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = 1;
+    }
+
+    int c = size / TCACHE_GRANULE;
+    if (tcache.count[c] == TCACHE_COUNT) {
+        // The oldest blocks of the class go back to their arenas
+        mb_allocated_t *last = tcache.blocks[c];
+        for (int i = 1; i < TCACHE_COUNT - TCACHE_BATCH; i++) {
+            last = TCACHE_NEXT(last);
+        }
+        tcache_flush(TCACHE_NEXT(last));
+        TCACHE_NEXT(last) = NULL;
+        tcache.count[c] -= TCACHE_BATCH;
+    }
+    TCACHE_NEXT(block) = tcache.blocks[c];
+    tcache.blocks[c] = block;
+    tcache.count[c]++;
+    return 1;
+}
+
+/* Takes a block of class c from the cache of the thread, refilling it if it is empty, returns NULL if the arena is full */
+static mb_allocated_t *tcache_pop(size_t c)
+{
+    mb_allocated_t *block;
+
+    if (tcache.blocks[c] == NULL) {
+        // (the blocks of the refill are only counted and traced when they are handed out)
+        arena_lock_thread();
+        for (int i = 0; i < TCACHE_BATCH; i++) {
+            block = heap_take(c * TCACHE_GRANULE - MB_HEADER_SIZE, NULL);
+            if (block == NULL) {
+                break;
+            }
+            TCACHE_NEXT(block) = tcache.blocks[c];
+            tcache.blocks[c] = block;
+            tcache.count[c]++;
+        }
+        arena_unlock();
+        if (tcache.blocks[c] == NULL) {
+            return NULL;
+        }
+    }
+
+    block = tcache.blocks[c];
+    tcache.blocks[c] = TCACHE_NEXT(block);
+    tcache.count[c]--;
+    return block;
+}
 
-#define ULONG(x)((long unsigned int)(x))
+/* Takes a block of the cache for 'size' bytes (refilling its class if it is empty), returns NULL if the request is not cached */
+static void *tcache_get(size_t size)
+{
+    if (size == 0 || size > TCACHE_MAX_SIZE || tcache.disabled) {
+        return NULL;
+    }
+    size_t c = (request_block_size(size) + TCACHE_GRANULE - 1) / TCACHE_GRANULE;
+    if (c >= TCACHE_NB_CLASSES) {
+        return NULL;
+    }
+#if defined(MEM_PCPU)
+    mb_allocated_t *block = PCPU_ACTIVE() ? pcpu_get(c) : tcache_pop(c);
+#else
+    mb_allocated_t *block = tcache_pop(c);
+#endif
+    if (block == NULL) {
+        return NULL;
+    }
 
-#if defined(FIRST_FIT)
+    // The allocation is counted in the current arena, whichever arena holds the block
+    stats_arena();
+    count_alloc(size, MB_SIZE(UNLOCKED_SIZE(block)));
+    print_alloc_info(PAYLOAD(block), size);
+    return PAYLOAD(block);
+}
+#endif
 
-void *memory_alloc(size_t size)
+#if defined(MEM_LFSLAB)
+/*
+ * Lock-free slabs: requests of at most LFSLAB_MAX_SIZE bytes are served,
+ * whatever the policy, by slabs that no lock protects. A slab is a page of
+ * a region reserved for them (LFSLAB_REGION_SIZE bytes mapped by
+ * memory_init, faulted in as the slabs are made), cut into slots of a
+ * single size class: an object is known to be a slot from its address,
+ * and its slab is the page that holds it.
+ * The bitmap of a slab has a bit set for each free slot. A slot is claimed
+ * by clearing its bit with an atomic fetch_and (it is taken if the bit was
+ * still set), and freed, by any thread, by setting its bit back with an
+ * atomic fetch_or.
+ * Each thread allocates from a slab of its own per class, so the threads
+ * only meet on a bitmap when one frees a slot of the slab of another. When
+ * its slab is full, a thread gives it up and adopts a slab of the class
+ * that has free slots and no owner, or makes a new one. The slabs are
+ * never given back, and their objects are not counted in the stats.
+ * The slabs with free slots and no owner are kept on a lock-free stack per
+ * class, so adopting one takes a single pop. A slab is pushed by the
+ * thread that gives it up if it still has free slots, or else by the first
+ * free that finds it without an owner; a flag in its state makes sure it
+ * is only pushed once.
+ */
+#define LFSLAB_MAX_SIZE 64
+#define LFSLAB_GRANULE (MEM_ALIGNMENT > 8 ? MEM_ALIGNMENT : 8)
+#define LFSLAB_NB_CLASSES (LFSLAB_MAX_SIZE / LFSLAB_GRANULE)
+#define LFSLAB_NB_WORDS (MEM_PAGE_SIZE / LFSLAB_GRANULE / 64)
+#define LFSLAB_REGION_SIZE ((size_t)256 << 20)
+
+struct lfslab {
+    uint64_t free_slots[LFSLAB_NB_WORDS];   /* bit set: free slot */
+    uint32_t next_partial;  /* next slab of the stack of the class (see lfslab_partial) */
+    int state;              /* LFSLAB_OWNED, LFSLAB_LISTED or 0 */
+    size_t slot_size;
+};
+
+/* States of a slab: a thread allocates from it, or it is on the stack of its class */
+#define LFSLAB_OWNED 1
+#define LFSLAB_LISTED 2
+
+/* First slot of a slab, and number of slots of a slab of the given slot size */
+#define LFSLAB_SLOTS(s) ((char *)(s) + ALIGN_UP(sizeof(struct lfslab), LFSLAB_GRANULE))
+#define LFSLAB_NB_SLOTS(slot_size) ((MEM_PAGE_SIZE - ALIGN_UP(sizeof(struct lfslab), LFSLAB_GRANULE)) / (slot_size))
+
+/* Region of the slabs, and its first page that is not a slab yet */
+static char *lfslab_start, *lfslab_end;
+static char *lfslab_brk;
+
+/*
+ * Stack of the slabs of each class with free slots and no owner. A slab is
+ * given by its number in the region plus one (0 ends the stack), in the
+ * low 32 bits of the top; the high 32 bits count the changes of the top,
+ * so that a pop fails if the slab it read has been popped and pushed back
+ * meanwhile (ABA).
+ */
+static uint64_t lfslab_partial[LFSLAB_NB_CLASSES];
+
+#define LFSLAB_NUMBER(s) ((uint32_t)(((char *)(s) - lfslab_start) / MEM_PAGE_SIZE + 1))
+#define LFSLAB_AT(n) ((struct lfslab *)(lfslab_start + ((size_t)(n) - 1) * MEM_PAGE_SIZE))
+
+/* Slab of each class the calling thread allocates from */
+static __thread struct lfslab *lfslab_current[LFSLAB_NB_CLASSES] __attribute__((tls_model("initial-exec")));
+
+static pthread_key_t lfslab_key;
+static pthread_once_t lfslab_once = PTHREAD_ONCE_INIT;
+
+/* Slab holding the object p, or NULL if p is not a slot */
+static struct lfslab *lfslab_of(void *p)
 {
-    // Check for invalid size
-    if (size == 0) {
-        return NULL; // Cannot allocate zero bytes
+    if ((size_t)((char *)p - lfslab_start) < (size_t)(lfslab_end - lfslab_start)) {
+        return (struct lfslab *)PAGE_FLOOR(p);
     }
+    return NULL;
+}
 
-    // Traverse the free block list to find a block that fits
-    mb_free_t *current = first_free, *prev = NULL;
-
-    while (current != NULL) {
-        if (current->size >= size + sizeof(mb_allocated_t)) {
-            if (current->size - size - sizeof(mb_allocated_t) <= sizeof(mb_free_t)) {
-                if (prev != NULL) prev->next = current->next;
-                    else first_free = current->next;
-                
-                mb_allocated_t *allocated_block = (mb_allocated_t *)current;
-                allocated_block->size = current->size - sizeof(mb_allocated_t);
-
-                print_alloc_info((void *)(allocated_block + 1), size);
-                return (void *)(allocated_block + 1); // Return a pointer immediately after metadata
-            }
-            // Calculate the address of the new free block after the allocated block
-            mb_free_t *new_free_block = (mb_free_t *)((char *)current + size + sizeof(mb_allocated_t));
-            new_free_block->size = current->size - sizeof(mb_allocated_t) - size;
-            new_free_block->next = current->next;
+/* Pushes the slab on the stack of its class */
+static void lfslab_push(struct lfslab *slab)
+{
+    uint64_t *stack = &lfslab_partial[slab->slot_size / LFSLAB_GRANULE - 1];
+    uint64_t old = __atomic_load_n(stack, __ATOMIC_RELAXED);
+    uint64_t new;
+
+    do {
+        __atomic_store_n(&slab->next_partial, (uint32_t)old, __ATOMIC_RELAXED);
+        new = ((old >> 32) + 1) << 32 | LFSLAB_NUMBER(slab);
+    } while (!__atomic_compare_exchange_n(stack, &old, new, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
-            // Found a block that can accommodate the requested size and metadata
-            mb_allocated_t *allocated_block = (mb_allocated_t *)current;
-            allocated_block->size = size;
+/* Pops a slab of class c, returns NULL if the stack is empty */
+static struct lfslab *lfslab_pop(int c)
+{
+    uint64_t old = __atomic_load_n(&lfslab_partial[c], __ATOMIC_ACQUIRE);
+
+    while ((uint32_t)old != 0) {
+        // (a slab is never unmapped: its link can be read even if it has been popped meanwhile)
+        struct lfslab *slab = LFSLAB_AT((uint32_t)old);
+        uint64_t new = ((old >> 32) + 1) << 32 | __atomic_load_n(&slab->next_partial, __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&lfslab_partial[c], &old, new, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            return slab;
+        }
+    }
+    return NULL;
+}
 
-            // Update the linked list of free blocks
-            if (prev != NULL) prev->next = new_free_block;
-                else first_free = new_free_block;
+/* Pushes the slab if it has no owner and is not on the stack yet */
+static void lfslab_list(struct lfslab *slab)
+{
+    int unowned = 0;
 
-            // Call print_alloc_info to print allocation information
-            print_alloc_info((void *)(allocated_block + 1), size);
+    if (__atomic_compare_exchange_n(&slab->state, &unowned, LFSLAB_LISTED, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        lfslab_push(slab);
+    }
+}
 
-            return (void *)(allocated_block + 1); // Return a pointer immediately after metadata
+/* Returns 1 if the slab has a free slot */
+static int lfslab_has_free(struct lfslab *slab)
+{
+    for (int w = 0; w < LFSLAB_NB_WORDS; w++) {
+        if (__atomic_load_n(&slab->free_slots[w], __ATOMIC_SEQ_CST) != 0) {
+            return 1;
         }
-        prev = current;
-        current = current->next;
     }
-
-    // No suitable block found, print an error message and return NULL
-    print_alloc_error(size);
-    return NULL;
+    return 0;
 }
 
-#elif defined(BEST_FIT)
+/*
+ * Gives up a slab of the calling thread. A slot freed at the same time may
+ * have seen the slab still owned: the state is written, and the bitmap read,
+ * in sequential consistency, as lfslab_free does it the other way round, so
+ * that either of them sees the free slot and pushes the slab.
+ */
+static void lfslab_disown(struct lfslab *slab)
+{
+    __atomic_store_n(&slab->state, 0, __ATOMIC_SEQ_CST);
+    if (lfslab_has_free(slab)) {
+        lfslab_list(slab);
+    }
+}
 
-void *memory_alloc(size_t size)
+/* Destructor of lfslab_key, called when a thread exits: its slabs can be adopted by the other threads */
+static void lfslab_exit(void *unused)
 {
-    // Check for invalid size
-    if (size == 0) {
-        return NULL; // Cannot allocate zero bytes
+    for (int c = 0; c < LFSLAB_NB_CLASSES; c++) {
+        if (lfslab_current[c] != NULL) {
+            lfslab_disown(lfslab_current[c]);
+            lfslab_current[c] = NULL;
+        }
     }
+}
 
-    // Initialize pointers for traversal
-    mb_free_t *current = first_free, *prev = NULL;
-    
-    // Initialize pointers to track free memory blocks
-    mb_free_t *best = NULL, *best_prev = NULL;
+static void lfslab_key_create(void)
+{
+    pthread_key_create(&lfslab_key, lfslab_exit);
+}
 
-    while (current != NULL) {
-        if (current->size >= size + sizeof(mb_allocated_t)) {
-            // Found a suitable block
-            if (best == NULL || best->size > current->size) {
-                best = current;
-                best_prev = prev;
+/* Claims a free slot of the slab, returns NULL if there is none */
+static void *lfslab_claim(struct lfslab *slab)
+{
+    for (int w = 0; w < LFSLAB_NB_WORDS; w++) {
+        uint64_t bits = __atomic_load_n(&slab->free_slots[w], __ATOMIC_RELAXED);
+        while (bits != 0) {
+            int b = __builtin_ctzll(bits);
+            uint64_t old = __atomic_fetch_and(&slab->free_slots[w], ~((uint64_t)1 << b), __ATOMIC_ACQUIRE);
+            if (old & ((uint64_t)1 << b)) {
+                return LFSLAB_SLOTS(slab) + (w * 64 + b) * slab->slot_size;
             }
+            bits = old; // Taken in the meantime: look at the bits as they are now
         }
-        // Move to the next block
-        prev = current;
-        current = current->next;
     }
+    return NULL;
+}
 
-    if (best != NULL) {
-        // Allocate memory from the best block
-        mb_allocated_t *allocated_block = (mb_allocated_t *)best;
-        mb_free_t *new_free_block, *current_next = best->next;
-        int new_free_block_size = 0;
+/*
+ * Gives up the slab of class c of the calling thread, and makes it adopt a
+ * slab of the class with free slots and no owner, or a new slab. Returns
+ * NULL if there is no such slab and the region is full.
+ */
+static struct lfslab *lfslab_adopt(int c)
+{
+    struct lfslab *slab, *old = lfslab_current[c];
 
-        if (best->size - size - sizeof(mb_allocated_t) <= sizeof(mb_free_t)) {
-            // Not enough space for a new free block
-            allocated_block->size = best->size - sizeof(mb_allocated_t);
-        } else {
-            // Create a new free block after the allocated block
-            new_free_block_size = best->size - sizeof(mb_allocated_t) - size;
-            allocated_block->size = size;
-        }
+    // The slabs of the thread are given up when it exits
+    pthread_once(&lfslab_once, lfslab_key_create);
+    if (pthread_getspecific(lfslab_key) == NULL) {
+        pthread_setspecific(lfslab_key, lfslab_current);
+    }
 
-        // Calculate the address of the new free block after the allocated block
-        if (new_free_block_size != 0) {
-            new_free_block = (mb_free_t *)((char *)best + size + sizeof(mb_allocated_t));
-            new_free_block->size = new_free_block_size;
-            new_free_block->next = current_next;
-        } else {
-            new_free_block = current_next;
-        }
+    lfslab_current[c] = NULL;
+    if (old != NULL) {
+        lfslab_disown(old);
+    }
+    // A slab of the stack has free slots: only its owner claims slots, and it has none
+    slab = lfslab_pop(c);
+    if (slab != NULL) {
+        __atomic_store_n(&slab->state, LFSLAB_OWNED, __ATOMIC_RELAXED);
+        lfslab_current[c] = slab;
+        return slab;
+    }
 
-        // Update the head node of the linked list of free blocks
-        if (best_prev != NULL) {
-            best_prev->next = new_free_block;
-        } else {
-            first_free = new_free_block;
+    char *page = __atomic_fetch_add(&lfslab_brk, MEM_PAGE_SIZE, __ATOMIC_RELAXED);
+    if (page >= lfslab_end) {
+        return NULL;
+    }
+    slab = (struct lfslab *)page;
+    slab->slot_size = (c + 1) * LFSLAB_GRANULE;
+    slab->state = LFSLAB_OWNED;
+    size_t nb_slots = LFSLAB_NB_SLOTS(slab->slot_size);
+    for (int w = 0; w < LFSLAB_NB_WORDS; w++) {
+        slab->free_slots[w] = nb_slots >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << nb_slots) - 1;
+        nb_slots -= nb_slots >= 64 ? 64 : nb_slots;
+    }
+    lfslab_current[c] = slab;
+    return slab;
+}
+
+/* Allocates a slot for 'size' bytes (at most LFSLAB_MAX_SIZE), returns NULL if the region is full */
+static void *lfslab_alloc(size_t size)
+{
+    int c = (size - 1) / LFSLAB_GRANULE;
+    struct lfslab *slab = lfslab_current[c];
+    void *p;
+
+    while (slab == NULL || (p = lfslab_claim(slab)) == NULL) {
+        slab = lfslab_adopt(c);
+        if (slab == NULL) {
+            return NULL;
         }
+    }
+    return p;
+}
 
-        // Call print_alloc_info to print allocation information
-        print_alloc_info((void *)(allocated_block + 1), size);
+static void lfslab_free(struct lfslab *slab, void *p)
+{
+    size_t slot = ((char *)p - LFSLAB_SLOTS(slab)) / slab->slot_size;
 
-        return (void *)(allocated_block + 1); // Return a pointer immediately after metadata
+    __atomic_fetch_or(&slab->free_slots[slot / 64], (uint64_t)1 << slot % 64, __ATOMIC_SEQ_CST);
+    // A slab without owner can be adopted again once it has a free slot (see lfslab_disown)
+    if (__atomic_load_n(&slab->state, __ATOMIC_SEQ_CST) == 0) {
+        lfslab_list(slab);
     }
-
-    // No suitable block found, print an error message and return NULL
-    print_alloc_error(size);
-    return NULL;
 }
+#endif
 
-#elif defined(NEXT_FIT)
+void memory_init(void)
+{
+    /* register the function that will be called when the programs exits */
+    atexit(run_at_exit);
+#if defined(MEM_ARENAS)
+    pthread_atfork(arena_fork_prepare, arena_fork_parent, arena_fork_child);
+#endif
+
+#if defined(MEM_PCPU)
+    // The per-CPU caches are only used if glibc registered the threads with rseq
+    if (__rseq_size > 0) {
+        pcpu_nb_cpus = sysconf(_SC_NPROCESSORS_CONF);
+        pcpu_caches = my_mmap(pcpu_nb_cpus * sizeof(struct pcpu_cache));
+    }
+#endif
+#if defined(MEM_LFSLAB)
+    // The pages of the region are only faulted in when slabs are made in them
+    lfslab_start = my_mmap(LFSLAB_REGION_SIZE);
+    if (lfslab_start != NULL) {
+        lfslab_end = lfslab_start + LFSLAB_REGION_SIZE;
+        lfslab_brk = lfslab_start;
+    }
+#endif
 
-// Define a global pointer to track the next fit position
-static mb_free_t *next_fit_ptr = NULL;
+    // The calling thread gets the first arena
+    arena_lock_thread();
+    heap_start = chunks[0].start;
+    arena_unlock();
+}
 
-void *memory_alloc(size_t size)
+static void *arena_alloc(size_t size)
 {
     // Check for invalid size
     if (size == 0) {
         return NULL; // Cannot allocate zero bytes
     }
-
-    // Check for the first allocation
-    if (next_fit_ptr == NULL) {
-        next_fit_ptr = first_free;
+#if defined(MEM_MMAP_THRESHOLD)
+    if (size >= MEM_MMAP_THRESHOLD) {
+        return mapped_alloc(size, MEM_ALIGNMENT);
     }
-
-    // Start the search for a block to fit from the next_fit_ptr position
-    mb_free_t *current = next_fit_ptr, *prev = NULL;
-
-    while (current != NULL) {
-        if (current->size >= size + sizeof(mb_allocated_t)) {
-            if (current->size - size - sizeof(mb_allocated_t) <= sizeof(mb_free_t)) {
-                if (prev != NULL) prev->next = current->next;
-                else first_free = current->next;
-
-                mb_allocated_t *allocated_block = (mb_allocated_t *)current;
-                allocated_block->size = current->size - sizeof(mb_allocated_t);
-
-                // Update next_fit_ptr to point to the next free block
-                next_fit_ptr = current->next;
-
-                print_alloc_info((void *)(allocated_block + 1), size);
-                return (void *)(allocated_block + 1); // Return a pointer immediately after metadata
-            }
-            // Calculate the address of the new free block after the allocated block
-            mb_free_t *new_free_block = (mb_free_t *)((char *)current + size + sizeof(mb_allocated_t));
-            new_free_block->size = current->size - sizeof(mb_allocated_t) - size;
-            new_free_block->next = current->next;
-
-            // Found a block that can accommodate the requested size and metadata
-            mb_allocated_t *allocated_block = (mb_allocated_t *)current;
-
-            // Update the linked list of free blocks
-            if (prev != NULL) prev->next = new_free_block;
-            else first_free = new_free_block;
-
-            // Update next_fit_ptr to point to the next free block
-            next_fit_ptr = new_free_block;
-
-            // Call print_alloc_info to print allocation information
-            print_alloc_info((void *)(allocated_block + 1), size);
-
-            return (void *)(allocated_block + 1); // Return a pointer immediately after metadata
+#endif
+#if defined(MEM_SLAB)
+    if (size <= SLAB_MAX_SIZE) {
+        void *p = slab_alloc(size);
+        if (p != NULL) {
+            return p;
         }
-        prev = current;
-        current = current->next;
     }
-
-    // No suitable block found, print an error message and return NULL
-    print_alloc_error(size);
-    return NULL;
+#endif
+    return heap_alloc(size, NULL);
 }
 
+void *memory_alloc(size_t size)
+{
+    if (size > MEM_MAX_SIZE) {
+        return NULL;
+    }
+#if defined(MEM_LFSLAB)
+    if (size != 0 && size <= LFSLAB_MAX_SIZE) {
+        void *slot = lfslab_alloc(size);
+        if (slot != NULL) {
+            print_alloc_info(slot, size);
+            return slot;
+        }
+    }
+#endif
+#if defined(MEM_TCACHE)
+    void *cached = tcache_get(size);
+    if (cached != NULL) {
+        return cached;
+    }
+#endif
+    arena_lock_thread();
+    void *p = arena_alloc(size);
+    arena_unlock();
+#if defined(MEM_TCACHE)
+    if (p == NULL && tcache_drain()) {
+        return memory_alloc(size);
+    }
 #endif
+    return p;
+}
 
-void run_at_exit(void)
+void *memory_alloc_aligned(size_t alignment, size_t size)
 {
-    fprintf(stderr,"YEAH B-)\n");
-    
-    /* TODO: insert your code here */
+    if (size > MEM_MAX_SIZE || alignment > MEM_MAX_SIZE) {
+        return NULL;
+    }
+    arena_lock_thread();
+    void *p = arena_alloc_aligned(alignment, size);
+    arena_unlock();
+#if defined(MEM_TCACHE)
+    if (p == NULL && tcache_drain()) {
+        return memory_alloc_aligned(alignment, size);
+    }
+#endif
+    return p;
 }
 
-void memory_init(void)
+/*
+ * Blocks that have not been used since they were mapped are already
+ * filled with zeros: only the words written by the free block metadata
+ * are cleared, the rest of the payload is not touched.
+ */
+static void *arena_calloc(size_t size)
 {
-    /* register the function that will be called when the programs exits */
-    atexit(run_at_exit);
+    void *p;
+    int zero;
 
-    /* TODO: insert your code here */
-    /* Use my_mmap to allocate the memory region (MEM_POOL_SIZE bytes) */
-    heap_start = my_mmap(MEM_POOL_SIZE);
+#if defined(MEM_MMAP_THRESHOLD)
+    if (size >= MEM_MMAP_THRESHOLD) {
+        return mapped_alloc(size, MEM_ALIGNMENT); // Fresh pages are zero
+    }
+#endif
+#if defined(MEM_SLAB)
+    if (size <= SLAB_MAX_SIZE && (p = slab_alloc(size)) != NULL) {
+        memset(p, 0, size);
+        return p;
+    }
+#endif
+    p = heap_alloc(size, &zero);
+    if (p != NULL && !zero) {
+        memset(p, 0, size);
+    }
+    return p;
+}
 
-    first_free = (mb_free_t *)heap_start;
-    first_free->size = MEM_POOL_SIZE;
-    first_free->next = NULL;
+void *memory_calloc(size_t nmemb, size_t size)
+{
+    // Check for an overflow of the total size
+    if (size != 0 && nmemb > (size_t)-1 / size) {
+        return NULL;
+    }
+    size *= nmemb;
+    if (size == 0) {
+        return NULL; // Cannot allocate zero bytes
+    }
+    if (size > MEM_MAX_SIZE) {
+        return NULL;
+    }
+#if defined(MEM_LFSLAB)
+    if (size <= LFSLAB_MAX_SIZE) {
+        void *slot = lfslab_alloc(size);
+        if (slot != NULL) {
+            memset(slot, 0, size);
+            print_alloc_info(slot, size);
+            return slot;
+        }
+    }
+#endif
+#if defined(MEM_TCACHE)
+    void *cached = tcache_get(size);
+    if (cached != NULL) {
+        memset(cached, 0, size);
+        return cached;
+    }
+#endif
+    arena_lock_thread();
+    void *p = arena_calloc(size);
+    arena_unlock();
+#if defined(MEM_TCACHE)
+    if (p == NULL && tcache_drain()) {
+        return memory_calloc(1, size);
+    }
+#endif
+    return p;
 }
 
-void memory_free(void *p) {
-    /* TODO: insert your code here */
+void memory_free(void *p)
+{
     if (p == NULL) {
         return; // Ignore freeing NULL pointers
     }
     print_free_info(p);
 
-    // The metadata of the block to free is immediately before the allocated block
-    mb_allocated_t *p_metadata = (mb_allocated_t *)p - 1;
-    size_t free_block_size = p_metadata->size + sizeof(mb_allocated_t);
-
-    // Traverse the free list to find the correct position (don't want insert to the head of free list)
-    mb_free_t *current = first_free, *prev = NULL;
-    mb_free_t *new_free_block = (mb_free_t *)p_metadata;
+#if defined(MEM_LFSLAB)
+    struct lfslab *lfslab = lfslab_of(p);
+    if (lfslab != NULL) {
+        lfslab_free(lfslab, p);
+        return;
+    }
+#endif
+#if defined(MAPPED_UNLOCKED)
+    if (UNLOCKED_SIZE(HEADER(p)) & MB_MAPPED) {
+        stats_arena();
+        mapped_free(HEADER(p));
+        return;
+    }
+#endif
+#if defined(MEM_TCACHE)
+    if (tcache_put(p)) {
+        return;
+    }
+#endif
+#if defined(MEM_REMOTE)
+    if (remote_free(p)) {
+        return;
+    }
+#endif
+    arena_lock_owner(p);
+    arena_free(p);
+    arena_unlock();
+}
 
-    // Find the correct position to insert the newly freed block based on address
-    while (current != NULL && current < new_free_block) {
-        prev = current;
-        current = current->next;
+/* Moves the data of p to a new block of 'size' bytes (no arena locked: the new block comes from the arena of the calling thread) */
+static void *move_block(void *p, size_t size)
+{
+    void *new_p = memory_alloc(size);
+    if (new_p == NULL) {
+        return NULL; // The block is left untouched
     }
-    new_free_block->next = current;
-    new_free_block->size = free_block_size;
-    if (prev != NULL) prev->next = new_free_block;
-        else first_free = new_free_block;
+    size_t old_size = memory_get_allocated_block_size(p);
+    memcpy(new_p, p, old_size < size ? old_size : size);
+    memory_free(p);
+    return new_p;
+}
 
-    // Merge contiguous free blocks if necessary
-    if (prev != NULL && (char *)prev + prev->size == (char *)new_free_block) { // Inspect the prev block
-        prev->size += new_free_block->size; // absorb the size
-        prev->next = new_free_block->next;
-        new_free_block = prev;
+void *memory_realloc(void *p, size_t size)
+{
+    if (p == NULL) {
+        return memory_alloc(size);
+    }
+    if (size == 0) {
+        memory_free(p);
+        return NULL;
+    }
+    if (size > MEM_MAX_SIZE) {
+        return NULL; // The block is left untouched
+    }
 
-        #if defined(NEXT_FIT)
-        next_fit_ptr = NULL; // If the prev block is combined, the next_fit_ptr will be an invalid address
-        #endif
+#if defined(MEM_LFSLAB)
+    struct lfslab *lfslab = lfslab_of(p);
+    if (lfslab != NULL) {
+        // A slot cannot grow
+        return size <= lfslab->slot_size ? p : move_block(p, size);
+    }
+#endif
+#if defined(MAPPED_UNLOCKED)
+    if (UNLOCKED_SIZE(HEADER(p)) & MB_MAPPED) {
+        stats_arena();
+        return mapped_realloc(HEADER(p), size);
     }
+#endif
+    arena_lock_owner(p);
+#if defined(MEM_SLAB)
+    struct slab *slab = slab_of(p);
+    if (slab != NULL) {
+        size_t slot_size = slab->slot_size;
+        arena_unlock();
+        // A slot cannot grow
+        return size <= slot_size ? p : move_block(p, size);
+    }
+#endif
+
+    mb_allocated_t *block = HEADER(p);
 
-    if (current != NULL && (char *)new_free_block + new_free_block->size == (char *)current) { // Inspect the after block
-        new_free_block->size += current->size;
-        new_free_block->next = current->next;
+#if defined(MEM_MAPPED_BLOCKS)
+    if (block->size & MB_MAPPED) {
+        p = mapped_realloc(block, size);
+        arena_unlock();
+        return p;
     }
-    
+#endif
+    int resized = resize_in_place(block, size);
+    arena_unlock();
+    return resized ? p : move_block(p, size);
 }
 
 size_t memory_get_allocated_block_size(void *addr)
 {
+    mb_allocated_t *block = HEADER(addr);
 
-    /* TODO: insert your code here */
+#if defined(MEM_LFSLAB)
+    struct lfslab *lfslab = lfslab_of(addr);
+    if (lfslab != NULL) {
+        return lfslab->slot_size;
+    }
+#endif
+#if defined(MEM_SLAB)
+    arena_lock_owner(addr);
+    struct slab *slab = slab_of(addr);
+    arena_unlock();
+    if (slab != NULL) {
+        return slab->slot_size;
+    }
+#endif
 
-    return 0;
+    // (no lock taken: see SET_PREV_FREE)
+    size_t header = UNLOCKED_SIZE(block);
+#if defined(MEM_MAPPED_BLOCKS)
+    if (header & MB_MAPPED) {
+        // The payload goes up to the end of the mapping
+        return MAPPING(block) + MB_SIZE(header) - (char *)addr;
+    }
+#endif
+    // Everything after the header of the block can be used, rounding and unsplit remainder included
+    return MB_SIZE(header) - MB_HEADER_SIZE;
+}
+
+/*
+ * Gives back to the system the pages of every free block of the current
+ * arena, and unmaps the chunks added by the heap growth that are entirely
+ * free.
+ */
+static size_t arena_trim(void)
+{
+    size_t released = 0;
+    int i = 0;
+
+#if defined(MEM_QUICK)
+    quick_flush();
+#endif
+
+    while (i < nb_chunks) {
+        mb_free_t *block = (mb_free_t *)chunks[i].start;
+        char *end = (char *)chunks[i].start + chunks[i].size;
+
+#if !defined(BUDDY)
+        if (i > 0 && (block->size & MB_FREE) && (block->size & MB_LAST)) {
+            free_remove(block);
+#if defined(NEXT_FIT)
+            if (next_fit_ptr == block) {
+                next_fit_ptr = NULL;
+            }
+#endif
+            stats.nb_free_blocks--;
+            stats.free_bytes -= chunks[i].size;
+            stats.heap_bytes -= chunks[i].size;
+            stats.released_bytes += chunks[i].size;
+            released += chunks[i].size;
+            // The chunk is out of the lookups of arena_find before its pages can be mapped again
+            chunks_change_begin();
+            my_munmap_pool(chunks[i].start, chunks[i].size);
+#if defined(MEM_SLAB)
+            my_munmap(chunks[i].slab_pages, SLAB_MAP_SIZE(chunks[i].size));
+#endif
+            memmove(&chunks[i], &chunks[i + 1], (nb_chunks - i - 1) * sizeof(struct mem_chunk));
+            nb_chunks--;
+            chunks_change_end();
+            // The end of the newest chunk left is where the top block is now
+            top_end = (char *)chunks[nb_chunks - 1].start + chunks[nb_chunks - 1].size;
+            continue;
+        }
+#endif
+        // The unused end of a chunk cut by the buddy system has never been written: its size reads 0
+        while ((char *)block + sizeof(mb_free_t) <= end && BLOCK_SIZE(block) != 0) {
+            if ((block->size & MB_FREE) && !(block->size & MB_ZERO)) {
+                released += release_block(block);
+            }
+            if (block->size & MB_LAST) {
+                break;
+            }
+            block = NEXT_BLOCK(block);
+        }
+        i++;
+    }
+    return released;
+}
+
+size_t memory_trim(void)
+{
+    size_t released = 0;
+
+#if defined(MEM_TCACHE)
+    tcache_drain();
+#endif
+
+    for (int a = 0; a < NB_ARENAS; a++) {
+        arena_lock(&arenas[a]);
+        released += arena_trim();
+        arena_unlock();
+    }
+    return released;
 }
 
-int is_allocated(void *addr)
+size_t memory_get_largest_free_block(void)
 {
-    mb_free_t *free_block = (mb_free_t *)heap_start;
-    while (free_block != NULL) {
-        // Check if the address falls within a free block
-        if (addr >= (void *)(free_block + 1) && addr < (void *)((char *)free_block + free_block->size)) {
-            return 0; // Not allocated (it's within a free block)
+    size_t size = 0;
+
+    for (int a = 0; a < NB_ARENAS; a++) {
+        arena_lock(&arenas[a]);
+        if (nb_chunks > 0 && arena_largest_free_block() > size) {
+            size = arena_largest_free_block();
         }
-        free_block = free_block->next;
+        arena_unlock();
     }
+    return size;
+}
 
-    // If the address is not within any free block, consider it allocated
-    return 1;
+/* The stats of the arenas are added up */
+void memory_get_stats(struct mem_stats *s)
+{
+    memset(s, 0, sizeof(*s));
+    for (int a = 0; a < NB_ARENAS; a++) {
+        arena_lock(&arenas[a]);
+        s->nb_free_blocks += stats.nb_free_blocks;
+        s->free_bytes += stats.free_bytes;
+        // (counted without the lock by the thread caches, see count_alloc)
+        s->nb_allocs += __atomic_load_n(&stats.nb_allocs, __ATOMIC_RELAXED);
+        s->requested_bytes += __atomic_load_n(&stats.requested_bytes, __ATOMIC_RELAXED);
+        s->allocated_bytes += __atomic_load_n(&stats.allocated_bytes, __ATOMIC_RELAXED);
+        s->heap_bytes += stats.heap_bytes;
+        s->mapped_bytes += __atomic_load_n(&stats.mapped_bytes, __ATOMIC_RELAXED);
+        s->released_bytes += stats.released_bytes;
+        arena_unlock();
+    }
 }
 
 void print_mem_state(void)
 {
     printf("Memory State:\n");
 
-    char *mem_ptr = (char *)heap_start;
-    char *end_ptr = (char *)heap_start + MEM_POOL_SIZE;
+    // Walk the blocks of each chunk: 'X' for an allocated block, '.' for a free one
+    int a, i;
+    for (a = 0; a < NB_ARENAS; a++) {
+        arena_lock(&arenas[a]);
+        for (i = 0; i < nb_chunks; i++) {
+            mb_free_t *block = (mb_free_t *)chunks[i].start;
 
-    while (mem_ptr < end_ptr) {
-        if (is_allocated(mem_ptr)) {
-            // Allocated block, print 'X' to represent an allocated byte
-            printf("X");
-            mem_ptr += sizeof(mb_allocated_t) + memory_get_allocated_block_size(mem_ptr);
-        } else {
-            // Free block, print '.' to represent a free byte
-            printf(".");
-            mem_ptr += sizeof(mb_free_t) + ((mb_free_t *)mem_ptr)->size;
+            if (a > 0 || i > 0) {
+                printf("|");
+            }
+            while ((char *)block + MB_MIN_SIZE <= (char *)chunks[i].start + chunks[i].size) {
+                printf((block->size & MB_FREE) ? "." : "X");
+                if (block->size & MB_LAST) {
+                    break;
+                }
+                block = NEXT_BLOCK(block);
+            }
         }
+        arena_unlock();
     }
 
     printf("\n");
 }
 
 void print_info(void) {
-    fprintf(stderr, "Memory : [%lu %lu] (%lu bytes)\n", (long unsigned int) heap_start, (long unsigned int) ((char*)heap_start+MEM_POOL_SIZE), (long unsigned int) (MEM_POOL_SIZE));
+    int a, i;
+    for (a = 0; a < NB_ARENAS; a++) {
+        arena_lock(&arenas[a]);
+        for (i = 0; i < nb_chunks; i++) {
+            fprintf(stderr, "Memory : [%lu %lu] (%lu bytes)\n", ULONG(chunks[i].start), ULONG((char*)chunks[i].start+chunks[i].size), ULONG(chunks[i].size));
+        }
+        arena_unlock();
+    }
 }
 
 void print_free_info(void *addr){
+#ifdef MEM_NO_TRACE
+    return;
+#endif
     if(addr){
         fprintf(stderr, "FREE  at : %lu \n", ULONG((char*)addr - (char*)heap_start));
     }
@@ -332,6 +3407,9 @@ void print_free_info(void *addr){
 }
 
 void print_alloc_info(void *addr, int size){
+#ifdef MEM_NO_TRACE
+  return;
+#endif
   if(addr){
     fprintf(stderr, "ALLOC at : %lu (%d byte(s))\n", 
 	    ULONG((char*)addr - (char*)heap_start), size);
@@ -348,6 +3426,47 @@ void print_alloc_error(int size)
 
 
 #ifdef MAIN
+#if defined(MEM_ARENAS)
+#define CHECK_NB_THREADS 3
+#define CHECK_NB_BLOCKS 4
+
+/*
+ * Frees the block given by the main thread, then allocates and frees
+ * small blocks filled with a pattern (the pool may be too small for all
+ * of them: an allocation can fail). Sets check_failed if a block was
+ * overwritten.
+ */
+static int check_failed = 0;
+
+static void *check_thread(void *given)
+{
+    unsigned char *blocks[CHECK_NB_BLOCKS] = {NULL};
+    unsigned char tag = (unsigned char)(uintptr_t)pthread_self();
+
+    memory_free(given);
+    for (int i = 0; i < 20000; i++) {
+        int j = i % CHECK_NB_BLOCKS;
+        size_t size = 1 + i % 16;
+        if (blocks[j] != NULL) {
+            for (int k = 0; k < 1 + (i - CHECK_NB_BLOCKS) % 16; k++) {
+                if (blocks[j][k] != tag) {
+                    check_failed = 1;
+                }
+            }
+            memory_free(blocks[j]);
+        }
+        blocks[j] = memory_alloc(size);
+        if (blocks[j] != NULL) {
+            memset(blocks[j], tag, size);
+        }
+    }
+    for (int j = 0; j < CHECK_NB_BLOCKS; j++) {
+        memory_free(blocks[j]);
+    }
+    return NULL;
+}
+#endif
+
 int main(int argc, char **argv) {
     memory_init();
     print_info();
@@ -367,6 +3486,100 @@ int main(int argc, char **argv) {
     void * b = memory_alloc(10);
     memory_free(a);
     memory_free(b);
+
+    // The whole usable size of a block can be written without overwriting its neighbour
+    for (size_t size = 1; size <= 64; size++) {
+        unsigned char *x = memory_alloc(size);
+        unsigned char *y = memory_alloc(size);
+        size_t usable_x = memory_get_allocated_block_size(x);
+        size_t usable_y = memory_get_allocated_block_size(y);
+
+        if (usable_x < size || usable_y < size) {
+            fprintf(stderr, "usable size too small for %lu bytes: %lu, %lu\n", ULONG(size), ULONG(usable_x), ULONG(usable_y));
+            return EXIT_FAILURE;
+        }
+        memset(x, 0xAA, usable_x);
+        memset(y, 0xBB, usable_y);
+        for (size_t i = 0; i < usable_x; i++) {
+            if (x[i] != 0xAA) {
+                fprintf(stderr, "block of %lu bytes overwritten at byte %lu\n", ULONG(size), ULONG(i));
+                return EXIT_FAILURE;
+            }
+        }
+        memory_free(x);
+        memory_free(y);
+    }
+
+    // Zeroed blocks, taken from fresh and from reused memory
+    for (size_t size = 1; size <= 200; size += 13) {
+        unsigned char *x = memory_alloc(size);
+        memset(x, 0xFF, memory_get_allocated_block_size(x));
+        memory_free(x);
+        unsigned char *y = memory_calloc(size, 1);
+        unsigned char *z = memory_calloc(1, size);
+        for (size_t i = 0; i < size; i++) {
+            if (y[i] != 0 || z[i] != 0) {
+                fprintf(stderr, "calloc of %lu bytes not zeroed at byte %lu\n", ULONG(size), ULONG(i));
+                return EXIT_FAILURE;
+            }
+        }
+        memory_free(y);
+        memory_free(z);
+    }
+    if (memory_calloc((size_t)1 << (sizeof(size_t) * 4), (size_t)1 << (sizeof(size_t) * 4)) != NULL) {
+        fprintf(stderr, "calloc overflow not detected\n");
+        return EXIT_FAILURE;
+    }
+    if (memory_calloc(1, (size_t)-1) != NULL || memory_alloc((size_t)-1 - 4) != NULL || memory_alloc_aligned(64, (size_t)-1 - 64) != NULL) {
+        fprintf(stderr, "block size overflow not detected\n");
+        return EXIT_FAILURE;
+    }
+    a = memory_alloc(10);
+    memset(a, 0xAA, 10);
+    if (memory_realloc(a, (size_t)-1 - 4) != NULL || ((unsigned char *)a)[9] != 0xAA) {
+        fprintf(stderr, "realloc overflow not detected\n");
+        return EXIT_FAILURE;
+    }
+    memory_free(a);
+
+    // Aligned blocks, separated by the free blocks split off before them
+    for (size_t alignment = 16; alignment <= 256; alignment *= 2) {
+        unsigned char *x = memory_alloc(1);
+        unsigned char *y = memory_alloc_aligned(alignment, 40);
+        unsigned char *z = memory_alloc_aligned(alignment, 1);
+
+        if (y == NULL || z == NULL || (uintptr_t)y % alignment != 0 || (uintptr_t)z % alignment != 0) {
+            fprintf(stderr, "block not aligned on %lu bytes: %p, %p\n", ULONG(alignment), (void *)y, (void *)z);
+            return EXIT_FAILURE;
+        }
+        memset(y, 0xAA, memory_get_allocated_block_size(y));
+        memset(z, 0xBB, memory_get_allocated_block_size(z));
+        for (size_t i = 0; i < 40; i++) {
+            if (y[i] != 0xAA) {
+                fprintf(stderr, "aligned block overwritten at byte %lu\n", ULONG(i));
+                return EXIT_FAILURE;
+            }
+        }
+        memory_free(x);
+        memory_free(y);
+        memory_free(z);
+    }
+
+#if defined(MEM_ARENAS)
+    // Threads allocating and freeing at once, and freeing blocks of another thread
+    pthread_t threads[CHECK_NB_THREADS];
+    for (int t = 0; t < CHECK_NB_THREADS; t++) {
+        pthread_create(&threads[t], NULL, check_thread, memory_alloc(8));
+    }
+    for (int t = 0; t < CHECK_NB_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    if (check_failed) {
+        fprintf(stderr, "block overwritten by another thread\n");
+        return EXIT_FAILURE;
+    }
+#endif
+
     memory_alloc(10);
 
     return EXIT_SUCCESS;
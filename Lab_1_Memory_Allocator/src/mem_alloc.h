@@ -8,8 +8,26 @@
 void memory_init(void);
 void *memory_alloc(size_t size);
 void memory_free(void *p);
+void *memory_realloc(void *p, size_t size);
+void *memory_calloc(size_t nmemb, size_t size);
+size_t memory_trim(void); /* returns the number of bytes given back to the system */
+size_t memory_get_largest_free_block(void); /* size of the largest free block, metadata included */
+void *memory_alloc_aligned(size_t alignment, size_t size); /* alignment: a power of two */
 size_t memory_get_allocated_block_size(void *addr);
 
+/* Statistics about the free blocks of the allocator */
+struct mem_stats {
+    size_t nb_free_blocks;  /* number of free blocks */
+    size_t free_bytes;      /* total size of the free blocks (metadata included) */
+    size_t nb_allocs;       /* number of successful allocations */
+    size_t requested_bytes; /* total size requested by these allocations */
+    size_t allocated_bytes; /* total size of the blocks given to them (metadata included) */
+    size_t heap_bytes;      /* total size of the chunks mapped for the heap */
+    size_t mapped_bytes;    /* total size of the regions mapped for large allocations */
+    size_t released_bytes;  /* total size of the pages given back to the system (madvise, unmapped chunks) */
+};
+void memory_get_stats(struct mem_stats *stats);
+
 
 /////////////////////////////////////////////////////////
 /* Functions for testing and debugging: */
@@ -13,7 +13,7 @@ simulator_state_t *sim_state;
 void memory_init_sim(size_t pool_size, policy_t policy, unsigned alignment)
 {
 
-    sim_state = sim_init(pool_size, policy, alignment, sizeof(mb_free_t), sizeof(mb_allocated_t));
+    sim_state = sim_init(pool_size, policy, alignment, MB_MIN_SIZE, sizeof(mb_allocated_t));
 }
 
 
@@ -5,6 +5,8 @@
 #include <assert.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include "mem_alloc.h"
 #include "mem_alloc_types.h"
@@ -67,11 +69,21 @@ void *handle_bootstrap_alloc(size_t size) {
     return res;
 }
 
+/* Returns a buffer whose start is rounded up to 'alignment', or NULL if the request does not fit in a buffer */
+void *handle_bootstrap_alloc_aligned(size_t alignment, size_t size) {
+    if (size > BOOTSTRAP_BUFFER_SIZE || alignment > BOOTSTRAP_BUFFER_SIZE - size) {
+        return NULL;
+    }
+    uintptr_t buf = (uintptr_t)handle_bootstrap_alloc(BOOTSTRAP_BUFFER_SIZE);
+    return (void *)((buf + alignment - 1) & ~(uintptr_t)(alignment - 1));
+}
+
 void handle_bootstrap_free(void *p) {
     int i = 0;
     debug_printf("enter - p = %p\n", p);
     while (i < NB_BOOTSTRAP_BUFFERS) {
-        if (p == (void*)bootstrap_buffers[i].buf) {
+        /* (the start of an aligned request may be inside the buffer) */
+        if ((uint8_t*)p >= bootstrap_buffers[i].buf && (uint8_t*)p < bootstrap_buffers[i].buf + BOOTSTRAP_BUFFER_SIZE) {
             used_bootstrap_buffers[i] = 0;
             memset(&(bootstrap_buffers[i].buf), 0, BOOTSTRAP_BUFFER_SIZE);
             break;
@@ -115,6 +127,9 @@ void *malloc(size_t size){
   }  
   
   res = memory_alloc(size);
+  if (res == NULL && size != 0) {
+      errno = ENOMEM;
+  }
   debug_printf("return = %p\n", res);
   return res;
 }
@@ -147,7 +162,11 @@ void *calloc(size_t nmemb, size_t size)
         //print_info();
         __mem_alloc_init_completed = 1;
     } else if (!__mem_alloc_init_completed) {
-      return handle_bootstrap_alloc(size);
+      /* The bootstrap buffers are kept zeroed */
+      if (size != 0 && nmemb > BOOTSTRAP_BUFFER_SIZE / size) {
+          return NULL;
+      }
+      return handle_bootstrap_alloc(nmemb * size);
     }
 
 #ifdef CALLOC_INTERPOSITION_PASSTROUGH
@@ -157,9 +176,10 @@ void *calloc(size_t nmemb, size_t size)
     return res;
 #endif
 
-    res = memory_alloc(size*nmemb);
-    if (res != NULL) {
-        explicit_bzero(res, size);
+    /* Checks the overflow of nmemb * size, and only zeroes the memory that is not known to be zero */
+    res = memory_calloc(nmemb, size);
+    if (res == NULL && nmemb != 0 && size != 0) {
+        errno = ENOMEM;
     }
 
     debug_printf("return = %p\n", res);
@@ -167,10 +187,24 @@ void *calloc(size_t nmemb, size_t size)
 }
 #endif
 
+size_t malloc_usable_size(void *ptr){
+    size_t res;
+
+    debug_printf("enter: ptr = %p\n", ptr);
+
+    if (ptr == NULL) {
+        return 0;
+    }
+    if (is_bootstrap_buffer(ptr)) {
+        return BOOTSTRAP_BUFFER_SIZE;
+    }
+    res = memory_get_allocated_block_size(ptr);
+    debug_printf("return = %ld\n", res);
+    return res;
+}
+
 void *realloc(void *ptr, size_t size){
 
-    void *new;
-    size_t old_size;
     void *res;
 
     debug_printf("enter: ptr = %p, size = %ld\n", ptr, size);
@@ -215,17 +249,100 @@ void *realloc(void *ptr, size_t size){
 #endif
 
     /*
-     * The reallocation is naive/suboptimal (systematic copy) but does not require to
-     * expose much of the allocator internals, nor to support realloc within the allocator.
+     * The block is resized in place when possible, otherwise moved to a new block.
+     * If the allocation fails, the original block is left untouched, as required
+     * in the specification.
      */
-    new = memory_alloc(size);
-    if (new == NULL) {
-        /* The original block is left untouched, as required in the specification. */
-        return NULL; 
-    }
-    old_size = memory_get_allocated_block_size(ptr);
-    memcpy(new, ptr, old_size); /* works because the two areas do not overlap */
-    free(ptr);
-    debug_printf("return = %p\n", new);
-    return new;
+    res = memory_realloc(ptr, size);
+    if (res == NULL) {
+        errno = ENOMEM;
+    }
+    debug_printf("return = %p\n", res);
+    return res;
+}
+
+/* Returns 1 if memory was given back to the system. The whole heap is trimmed: pad is ignored. */
+int malloc_trim(size_t pad){
+    debug_printf("enter: pad = %ld\n", pad);
+
+    if (!__mem_alloc_init_completed) {
+        return 0;
+    }
+    return memory_trim() > 0;
+}
+
+/****************************************************************************/
+/* Aligned allocations (POSIX and C11) */
+
+void *memalign(size_t alignment, size_t size){
+    void *res;
+
+    debug_printf("enter: alignment = %ld, size = %ld\n", alignment, size);
+
+    if(!__mem_alloc_init_flag){
+        __mem_alloc_init_flag = 1;
+        init_bootstrap_buffers();
+        memory_init();
+        __mem_alloc_init_completed = 1;
+    }
+
+    /* The alignment must be a power of two */
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (!__mem_alloc_init_completed) {
+        /* The request is served by a bootstrap buffer, if it fits */
+        res = handle_bootstrap_alloc_aligned(alignment, size);
+        if (res == NULL) {
+            errno = ENOMEM;
+        }
+        debug_printf("return = %p\n", res);
+        return res;
+    }
+
+    res = memory_alloc_aligned(alignment, size);
+    if (res == NULL && size != 0) {
+        errno = ENOMEM;
+    }
+    debug_printf("return = %p\n", res);
+    return res;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size){
+    void *res;
+
+    /* The alignment must also be a multiple of sizeof(void *) */
+    if (alignment == 0 || alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    res = memalign(alignment, size);
+    if (res == NULL && size != 0) {
+        return ENOMEM;
+    }
+    *memptr = res;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size){
+    return memalign(alignment, size);
+}
+
+void *valloc(size_t size){
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size){
+    size_t page_size = sysconf(_SC_PAGESIZE);
+
+    /* The size is rounded up to a multiple of the page size (one page for 0, as glibc does) */
+    if (size > SIZE_MAX - page_size + 1) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (size == 0) {
+        size = page_size;
+    }
+    return memalign(page_size, (size + page_size - 1) & ~(page_size - 1));
 }
@@ -3,10 +3,45 @@
 
 
 
+/*
+ * Every block, free or allocated, starts with a size_t holding the size of
+ * the whole block (metadata included). The most significant bits of this
+ * word are used as flags:
+ *  - MB_FREE: the block is free
+ *  - MB_PREV_FREE: the block located just before is free
+ *  - MB_LAST: the block is the last one of the memory region
+ *  - MB_MAPPED: the block is not in the heap but has its own mapping
+ *    (large allocations, see MEM_MMAP_THRESHOLD)
+ *  - MB_ZERO: the block is free and all its bytes are zero, except its
+ *    metadata (mb_free_t and footer): it has not been used since it was
+ *    mapped
+ * A free block also stores its size in its last word (footer), so that the
+ * block following it can find where it starts. Together with MB_PREV_FREE,
+ * this lets memory_free merge a block with its neighbours in constant time.
+ */
+#define MB_FREE      ((size_t)1 << (sizeof(size_t) * 8 - 1))
+#define MB_PREV_FREE ((size_t)1 << (sizeof(size_t) * 8 - 2))
+#define MB_LAST      ((size_t)1 << (sizeof(size_t) * 8 - 3))
+#define MB_MAPPED    ((size_t)1 << (sizeof(size_t) * 8 - 4))
+#define MB_ZERO      ((size_t)1 << (sizeof(size_t) * 8 - 5))
+#define MB_FLAGS     (MB_FREE | MB_PREV_FREE | MB_LAST | MB_MAPPED | MB_ZERO)
+#define MB_SIZE(s)   ((s) & ~MB_FLAGS)
+
 /* Structure declaration for a free block */
 struct mb_free{
     size_t size;
+#if defined(FIRST_FIT_TREE) || defined(BEST_FIT_TREE)
+    struct mb_free * left;      /* children in the tree of free blocks */
+    struct mb_free * right;
+#if defined(FIRST_FIT_TREE)
+    size_t max;                 /* size of the largest block of the subtree */
+#endif
+#elif defined(WORST_FIT)
+    size_t heap_index;          /* position in the heap of free blocks */
+#else
     struct mb_free * next;
+    struct mb_free * prev;
+#endif
 }; 
 typedef struct mb_free mb_free_t; 
 
@@ -16,5 +51,14 @@ struct mb_allocated{
 };
 typedef struct mb_allocated mb_allocated_t;
 
+/* Rounds x up to a multiple of MEM_ALIGNMENT: every block size is one */
+#define MB_ALIGN(x) ((((x) + MEM_ALIGNMENT - 1) / MEM_ALIGNMENT) * MEM_ALIGNMENT)
+
+/* Size of the header of an allocated block, so that the payload is aligned */
+#define MB_HEADER_SIZE MB_ALIGN(sizeof(mb_allocated_t))
+
+/* Smallest block: the free block metadata followed by the footer */
+#define MB_MIN_SIZE MB_ALIGN(sizeof(mb_free_t) + sizeof(size_t))
+
 
 #endif
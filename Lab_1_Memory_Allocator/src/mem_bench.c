@@ -0,0 +1,646 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "mem_alloc.h"
+
+/*
+ * Replays a mem_shell trace (read on stdin) and measures the time spent
+ * in each memory_alloc/memory_free call. The latencies are grouped by the
+ * number of free blocks in the heap when the call was made. Frees that
+ * merge the block with a free neighbour are reported separately from the
+ * ones that add a new block to the free lists. A summary gives the
+ * percentiles of the alloc and free latencies over the whole trace, and
+ * the internal fragmentation (share of the allocated bytes that were not
+ * requested: metadata, rounding, unsplit remainders).
+ *
+ * With options -g, -r and -c, a trace is generated on stdout instead (see
+ * gen_trace, gen_random_trace and gen_churn_trace). Option -t measures the page faults and
+ * the throughput of allocations that write their blocks (see touch_bench).
+ * Options -p and -s measure the throughput of concurrent threads (see
+ * thread_bench), option -o the memory held by the caches of more threads
+ * than CPUs (see footprint_bench), and option -x the throughput of
+ * producer and consumer threads (see remote_bench).
+ */
+
+#define SIZE_BUFFER 128
+
+/* Free block counts are grouped by powers of two: [0], [1], [2-3], [4-7], ... */
+#define NB_GROUPS 32
+
+struct latency {
+    unsigned long count;
+    double total;   /* in ns */
+    double max;     /* in ns */
+};
+
+static struct latency alloc_lat[NB_GROUPS], free_lat[NB_GROUPS], merge_lat[NB_GROUPS];
+
+/* Every latency measured, for the percentiles */
+struct samples {
+    double *values;
+    unsigned long count;
+    unsigned long capacity;
+};
+
+static struct samples alloc_samples, free_samples;
+
+static unsigned long failed_allocs = 0;
+
+static int group(size_t nb_free_blocks)
+{
+    int g = 0;
+    while (nb_free_blocks != 0 && g < NB_GROUPS - 1) {
+        nb_free_blocks >>= 1;
+        g++;
+    }
+    return g;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void record(struct latency *lat, double t)
+{
+    lat->count++;
+    lat->total += t;
+    if (t > lat->max) {
+        lat->max = t;
+    }
+}
+
+static void add_sample(struct samples *samples, double t)
+{
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity ? 2 * samples->capacity : 4096;
+        samples->values = realloc(samples->values, samples->capacity * sizeof(double));
+    }
+    samples->values[samples->count++] = t;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* p-th percentile of sorted samples */
+static double percentile(struct samples *samples, double p)
+{
+    unsigned long i = (unsigned long)(p / 100.0 * samples->count);
+    if (i >= samples->count) {
+        i = samples->count - 1;
+    }
+    return samples->values[i];
+}
+
+static void print_summary(const char *name, struct samples *samples)
+{
+    double total = 0;
+    unsigned long i;
+
+    if (samples->count == 0) {
+        return;
+    }
+    qsort(samples->values, samples->count, sizeof(double), compare_doubles);
+    for (i = 0; i < samples->count; i++) {
+        total += samples->values[i];
+    }
+    printf("%-14s %9lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, samples->count,
+           total / samples->count, percentile(samples, 50), percentile(samples, 99),
+           percentile(samples, 99.9), samples->values[samples->count - 1]);
+}
+
+/*
+ * Generates a trace of nb allocations of 16 to 271 bytes, then frees
+ * every other block (each free adds an isolated block to the free lists),
+ * then the remaining blocks (each free merges with both neighbours).
+ */
+static void gen_trace(int nb)
+{
+    unsigned seed = 1;
+    int i;
+
+    for (i = 1; i <= nb; i++) {
+        seed = seed * 1103515245 + 12345;
+        printf("a%u\n", 16 + (seed >> 16) % 256);
+    }
+    for (i = 1; i <= nb; i += 2) {
+        printf("f%d\n", i);
+    }
+    for (i = 2; i <= nb; i += 2) {
+        printf("f%d\n", i);
+    }
+    printf("q\n");
+}
+
+/*
+ * Generates a trace of nb random operations: the number of allocated
+ * blocks oscillates between 0 and a few thousands, most blocks are
+ * smaller than 128 bytes and a few of them reach 16KB.
+ */
+static void gen_random_trace(int nb)
+{
+    unsigned seed = 1;
+    int *live = malloc(nb * sizeof(int));
+    int nb_live = 0, count = 0, target = 0;
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        seed = seed * 1103515245 + 12345;
+        if (i % 4096 == 0) {
+            target = (seed >> 8) % 4096;
+        }
+        if (nb_live == 0 || (nb_live < target && (seed >> 16) % 4 != 0)
+            || (nb_live >= target && (seed >> 16) % 4 == 0)) {
+            unsigned r = (seed >> 4) % 100;
+            unsigned size;
+            seed = seed * 1103515245 + 12345;
+            if (r < 70) {
+                size = 1 + (seed >> 16) % 128;
+            } else if (r < 95) {
+                size = 128 + (seed >> 16) % 896;
+            } else {
+                size = 1024 + (seed >> 8) % 15360;
+            }
+            printf("a%u\n", size);
+            live[nb_live++] = ++count;
+        } else {
+            int j = (seed >> 16) % nb_live;
+            printf("f%d\n", live[j]);
+            live[j] = live[--nb_live];
+        }
+    }
+    free(live);
+    printf("q\n");
+}
+
+/* Blocks allocated by touch_bench */
+#define TOUCH_SIZE 1024
+
+static long nb_faults(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+/*
+ * Allocates nb blocks of TOUCH_SIZE bytes and writes each of them. The
+ * time and the page faults of memory_init (where the pages are prefaulted
+ * with MEM_PREFAULT) are reported apart from the ones of the allocations.
+ */
+static void touch_bench(int nb)
+{
+    long faults;
+    double t;
+    int i;
+
+    faults = nb_faults();
+    t = now_ns();
+    memory_init();
+    t = now_ns() - t;
+    faults = nb_faults() - faults;
+    printf("%-14s %10.2f ms %9ld faults\n", "memory_init", t / 1e6, faults);
+
+    faults = nb_faults();
+    t = now_ns();
+    for (i = 0; i < nb; i++) {
+        char *p = memory_alloc(TOUCH_SIZE);
+        if (p == NULL) {
+            failed_allocs++;
+            continue;
+        }
+        memset(p, i, TOUCH_SIZE);
+    }
+    t = now_ns() - t;
+    faults = nb_faults() - faults;
+    printf("%-14s %10.2f ms %9ld faults %10.1f MB/s\n", "alloc + touch", t / 1e6, faults,
+           1e3 * nb * TOUCH_SIZE / t);
+    printf("failed allocations: %lu\n", failed_allocs);
+}
+
+/*
+ * Generates a trace of nb operations where most frees are followed by the
+ * allocation of a block of the same size, as when objects of a few types
+ * are created and destroyed: a working set of about 2000 blocks of 8 sizes
+ * from 16 to 128 bytes, with one block in 16 of up to 4KB.
+ */
+static void gen_churn_trace(int nb)
+{
+    static const unsigned sizes[] = {16, 24, 32, 40, 48, 64, 96, 128};
+    unsigned seed = 1;
+    int *live = malloc(nb * sizeof(int));
+    unsigned *live_size = malloc(nb * sizeof(unsigned));
+    int nb_live = 0, count = 0;
+    int i = 0;
+
+    while (i < nb) {
+        unsigned size;
+        seed = seed * 1103515245 + 12345;
+        if (nb_live < 2000) {
+            size = (seed >> 16) % 16 == 0 ? 128 + (seed >> 8) % 3968 : sizes[(seed >> 16) % 8];
+        } else {
+            // Replace a block by a block of the same size
+            int j = (seed >> 16) % nb_live;
+            printf("f%d\n", live[j]);
+            size = live_size[j];
+            live[j] = live[--nb_live];
+            live_size[j] = live_size[nb_live];
+            i++;
+        }
+        printf("a%u\n", size);
+        live_size[nb_live] = size;
+        live[nb_live++] = ++count;
+        i++;
+    }
+    free(live);
+    free(live_size);
+    printf("q\n");
+}
+
+/* Operations made by each thread of thread_bench, and blocks each thread keeps allocated */
+#define THREAD_NB_OPERATIONS 500000
+#define THREAD_NB_BLOCKS 1024
+
+/* Sizes of the blocks of thread_bench */
+static size_t thread_min_size, thread_max_size;
+
+/*
+ * Allocates and frees blocks of thread_min_size to thread_max_size bytes
+ * at random: each operation frees a block of the working set of the
+ * thread, if it is allocated, and allocates another one in its place.
+ */
+static void *thread_run(void *arg)
+{
+    void *blocks[THREAD_NB_BLOCKS] = {NULL};
+    unsigned seed = (unsigned)(size_t)arg;
+    unsigned long failed = 0;
+    int i;
+
+    for (i = 0; i < THREAD_NB_OPERATIONS; i++) {
+        seed = seed * 1103515245 + 12345;
+        int j = (seed >> 16) % THREAD_NB_BLOCKS;
+        memory_free(blocks[j]);
+        blocks[j] = memory_alloc(thread_min_size + (seed >> 8) % (thread_max_size - thread_min_size + 1));
+        if (blocks[j] == NULL) {
+            failed++;
+        } else {
+            *(char *)blocks[j] = i;
+        }
+    }
+    for (i = 0; i < THREAD_NB_BLOCKS; i++) {
+        memory_free(blocks[i]);
+    }
+    return (void *)failed;
+}
+
+/*
+ * Runs thread_run in 1 to nb_threads threads at once, with blocks of
+ * min_size to max_size bytes, and prints the throughput of the allocator
+ * (operations per second, an allocation and a free each) and its speedup
+ * over a single thread.
+ */
+static void thread_bench(int nb_threads, size_t min_size, size_t max_size)
+{
+#if defined(MEM_ARENAS)
+    pthread_t *threads = malloc(nb_threads * sizeof(pthread_t));
+    double base = 0;
+    int n, i;
+
+    thread_min_size = min_size;
+    thread_max_size = max_size;
+    memory_init();
+    printf("%-8s %12s %14s %8s\n", "threads", "time (ms)", "Mops/s", "speedup");
+    for (n = 1; n <= nb_threads; n++) {
+        double t = now_ns();
+        for (i = 0; i < n; i++) {
+            pthread_create(&threads[i], NULL, thread_run, (void *)(size_t)(i + 1));
+        }
+        for (i = 0; i < n; i++) {
+            void *failed;
+            pthread_join(threads[i], &failed);
+            failed_allocs += (unsigned long)failed;
+        }
+        t = now_ns() - t;
+        double throughput = 1e3 * n * THREAD_NB_OPERATIONS / t;
+        if (n == 1) {
+            base = throughput;
+        }
+        printf("%-8d %12.2f %14.2f %8.2f\n", n, t / 1e6, throughput, throughput / base);
+    }
+    printf("failed allocations: %lu\n", failed_allocs);
+    free(threads);
+#else
+    fprintf(stderr, "the allocator is not thread-safe: build it with MEM_ARENAS\n");
+    exit(1);
+#endif
+}
+
+#if defined(MEM_ARENAS)
+/* The threads of footprint_bench are done, and can exit */
+static pthread_barrier_t footprint_done, footprint_exit;
+
+static void *footprint_run(void *arg)
+{
+    void *failed = thread_run(arg);
+
+    // The caches of the thread are measured before it exits (that drains its thread cache)
+    pthread_barrier_wait(&footprint_done);
+    pthread_barrier_wait(&footprint_exit);
+    return failed;
+}
+#endif
+
+/*
+ * Runs thread_run in 'factor' threads per CPU at once, with blocks of 16
+ * to 512 bytes. Once the threads are done (they have freed all of their
+ * blocks) but before they exit, the blocks of the heap that are not free
+ * are the ones held by the caches: prints their size, and the throughput
+ * of the allocator.
+ */
+static void footprint_bench(int factor)
+{
+#if defined(MEM_ARENAS)
+    int nb_threads = factor * sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t *threads = malloc(nb_threads * sizeof(pthread_t));
+    struct mem_stats before, after;
+    int i;
+
+    thread_min_size = 16;
+    thread_max_size = 512;
+    memory_init();
+    memory_get_stats(&before);
+    pthread_barrier_init(&footprint_done, NULL, nb_threads + 1);
+    pthread_barrier_init(&footprint_exit, NULL, nb_threads + 1);
+
+    double t = now_ns();
+    for (i = 0; i < nb_threads; i++) {
+        pthread_create(&threads[i], NULL, footprint_run, (void *)(size_t)(i + 1));
+    }
+    pthread_barrier_wait(&footprint_done);
+    t = now_ns() - t;
+    memory_get_stats(&after);
+    pthread_barrier_wait(&footprint_exit);
+    for (i = 0; i < nb_threads; i++) {
+        void *failed;
+        pthread_join(threads[i], &failed);
+        failed_allocs += (unsigned long)failed;
+    }
+
+    size_t held = (after.heap_bytes - after.free_bytes) - (before.heap_bytes - before.free_bytes);
+    printf("%-8s %12s %14s %14s\n", "threads", "time (ms)", "Mops/s", "cached (KB)");
+    printf("%-8d %12.2f %14.2f %14.1f\n", nb_threads, t / 1e6, 1e3 * nb_threads * THREAD_NB_OPERATIONS / t, held / 1024.0);
+    printf("failed allocations: %lu\n", failed_allocs);
+    pthread_barrier_destroy(&footprint_done);
+    pthread_barrier_destroy(&footprint_exit);
+    free(threads);
+#else
+    fprintf(stderr, "the allocator is not thread-safe: build it with MEM_ARENAS\n");
+    exit(1);
+#endif
+}
+
+/* Blocks allocated by each producer of remote_bench, and capacity of the ring that takes them to its consumer */
+#define REMOTE_NB_BLOCKS 500000
+#define REMOTE_RING_SIZE 256
+
+struct ring {
+    void *slots[REMOTE_RING_SIZE];
+    unsigned head __attribute__((aligned(64)));    /* blocks put by the producer */
+    unsigned tail __attribute__((aligned(64)));    /* blocks taken by the consumer */
+};
+
+/* Allocates blocks of 16 to 512 bytes and puts them in the ring (NULL for a failed allocation) */
+static void *producer_run(void *arg)
+{
+    struct ring *ring = arg;
+    unsigned seed = (unsigned)(size_t)ring;
+    unsigned long failed = 0;
+
+    for (unsigned i = 0; i < REMOTE_NB_BLOCKS; i++) {
+        seed = seed * 1103515245 + 12345;
+        void *p = memory_alloc(16 + (seed >> 8) % 497);
+        if (p == NULL) {
+            failed++;
+        } else {
+            *(char *)p = i;
+        }
+        while (i - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == REMOTE_RING_SIZE) {
+            sched_yield();
+        }
+        ring->slots[i % REMOTE_RING_SIZE] = p;
+        __atomic_store_n(&ring->head, i + 1, __ATOMIC_RELEASE);
+    }
+    return (void *)failed;
+}
+
+/* Frees the blocks of the ring */
+static void *consumer_run(void *arg)
+{
+    struct ring *ring = arg;
+
+    for (unsigned i = 0; i < REMOTE_NB_BLOCKS; i++) {
+        while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == i) {
+            sched_yield();
+        }
+        memory_free(ring->slots[i % REMOTE_RING_SIZE]);
+        __atomic_store_n(&ring->tail, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * Runs 1 to nb_pairs pairs of threads at once: in each pair, a producer
+ * allocates blocks and a consumer frees them, so that every free is made
+ * by another thread than the allocation. Prints the throughput of the
+ * allocator (blocks allocated and freed per second) and its speedup over a
+ * single pair.
+ */
+static void remote_bench(int nb_pairs)
+{
+#if defined(MEM_ARENAS)
+    pthread_t *threads = malloc(2 * nb_pairs * sizeof(pthread_t));
+    struct ring *rings = aligned_alloc(64, nb_pairs * sizeof(struct ring));
+    double base = 0;
+    int n, i;
+
+    memory_init();
+    printf("%-8s %12s %14s %8s\n", "pairs", "time (ms)", "Mblocks/s", "speedup");
+    for (n = 1; n <= nb_pairs; n++) {
+        memset(rings, 0, n * sizeof(struct ring));
+        double t = now_ns();
+        for (i = 0; i < n; i++) {
+            pthread_create(&threads[2 * i], NULL, producer_run, &rings[i]);
+            pthread_create(&threads[2 * i + 1], NULL, consumer_run, &rings[i]);
+        }
+        for (i = 0; i < 2 * n; i++) {
+            void *failed;
+            pthread_join(threads[i], &failed);
+            failed_allocs += (unsigned long)failed;
+        }
+        t = now_ns() - t;
+        double throughput = 1e3 * n * REMOTE_NB_BLOCKS / t;
+        if (n == 1) {
+            base = throughput;
+        }
+        printf("%-8d %12.2f %14.2f %8.2f\n", n, t / 1e6, throughput, throughput / base);
+    }
+    printf("failed allocations: %lu\n", failed_allocs);
+    free(rings);
+    free(threads);
+#else
+    fprintf(stderr, "the allocator is not thread-safe: build it with MEM_ARENAS\n");
+    exit(1);
+#endif
+}
+
+static void print_report(void)
+{
+    struct mem_stats stats;
+    int g;
+
+    printf("%-14s %9s %10s %10s %9s %10s %10s %9s %10s %10s\n", "free blocks",
+           "allocs", "mean (ns)", "max (ns)", "frees", "mean (ns)", "max (ns)",
+           "merges", "mean (ns)", "max (ns)");
+    for (g = 0; g < NB_GROUPS; g++) {
+        char range[32];
+        struct latency *a = &alloc_lat[g], *f = &free_lat[g], *m = &merge_lat[g];
+
+        if (a->count == 0 && f->count == 0 && m->count == 0) {
+            continue;
+        }
+        if (g == 0) {
+            snprintf(range, sizeof(range), "0");
+        } else {
+            snprintf(range, sizeof(range), "%lu-%lu", 1UL << (g - 1), (1UL << g) - 1);
+        }
+        printf("%-14s %9lu %10.1f %10.1f %9lu %10.1f %10.1f %9lu %10.1f %10.1f\n", range,
+               a->count, a->count ? a->total / a->count : 0.0, a->max,
+               f->count, f->count ? f->total / f->count : 0.0, f->max,
+               m->count, m->count ? m->total / m->count : 0.0, m->max);
+    }
+
+    printf("\n%-14s %9s %10s %10s %10s %10s %10s\n", "latency (ns)",
+           "count", "mean", "p50", "p99", "p99.9", "max");
+    print_summary("alloc", &alloc_samples);
+    print_summary("free", &free_samples);
+
+    memory_get_stats(&stats);
+    printf("\ninternal fragmentation: %.1f%% (%lu allocations, %lu bytes requested, %lu bytes allocated)\n",
+           stats.allocated_bytes ? 100.0 * (stats.allocated_bytes - stats.requested_bytes) / stats.allocated_bytes : 0.0,
+           (unsigned long)stats.nb_allocs, (unsigned long)stats.requested_bytes,
+           (unsigned long)stats.allocated_bytes);
+    printf("failed allocations: %lu\n", failed_allocs);
+    printf("free blocks at the end: %lu (%lu bytes, largest: %lu bytes)\n", (unsigned long)stats.nb_free_blocks,
+           (unsigned long)stats.free_bytes, (unsigned long)memory_get_largest_free_block());
+    printf("external fragmentation: %.1f%% (share of the free bytes outside the largest free block)\n",
+           stats.free_bytes ? 100.0 * (stats.free_bytes - memory_get_largest_free_block()) / stats.free_bytes : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+    char buffer[SIZE_BUFFER];
+    void **block_pointer;
+    int capacity = 1024;
+    int count = 1;
+    struct mem_stats stats, after;
+    double t;
+
+    if (argc > 2 && !strcmp(argv[1], "-g")) {
+        gen_trace(atoi(argv[2]));
+        return 0;
+    }
+    if (argc > 2 && !strcmp(argv[1], "-r")) {
+        gen_random_trace(atoi(argv[2]));
+        return 0;
+    }
+    if (argc > 2 && !strcmp(argv[1], "-c")) {
+        gen_churn_trace(atoi(argv[2]));
+        return 0;
+    }
+    if (argc > 2 && !strcmp(argv[1], "-t")) {
+        touch_bench(atoi(argv[2]));
+        return 0;
+    }
+    if (argc > 2 && !strcmp(argv[1], "-p")) {
+        thread_bench(atoi(argv[2]), 16, 512);
+        return 0;
+    }
+    if (argc > 2 && !strcmp(argv[1], "-s")) {
+        thread_bench(atoi(argv[2]), 8, 64);
+        return 0;
+    }
+    if (argc > 2 && !strcmp(argv[1], "-o")) {
+        footprint_bench(atoi(argv[2]));
+        return 0;
+    }
+    if (argc > 2 && !strcmp(argv[1], "-x")) {
+        remote_bench(atoi(argv[2]));
+        return 0;
+    }
+    if (argc > 1) {
+        fprintf(stderr, "usage: %s [-g nb_blocks | -r nb_operations | -c nb_operations | -t nb_blocks | -p nb_threads | -s nb_threads | -o threads_per_cpu | -x nb_pairs] < trace\n", argv[0]);
+        return 1;
+    }
+
+    block_pointer = calloc(capacity, sizeof(void *));
+    memory_init();
+
+    while (fgets(buffer, SIZE_BUFFER, stdin) != NULL) {
+        int value = atoi(buffer + 1);
+
+        switch (buffer[0]) {
+        case 'a':
+            if (count == capacity) {
+                block_pointer = realloc(block_pointer, 2 * capacity * sizeof(void *));
+                memset(block_pointer + capacity, 0, capacity * sizeof(void *));
+                capacity *= 2;
+            }
+            memory_get_stats(&stats);
+            t = now_ns();
+            block_pointer[count] = memory_alloc(value);
+            t = now_ns() - t;
+            if (block_pointer[count] == NULL && value != 0) {
+                failed_allocs++;
+            }
+            record(&alloc_lat[group(stats.nb_free_blocks)], t);
+            add_sample(&alloc_samples, t);
+            count++;
+            break;
+        case 'f':
+            if (value <= 0 || value >= count) {
+                fprintf(stderr, "Invalid block index: %d\n", value);
+                break;
+            }
+            memory_get_stats(&stats);
+            t = now_ns();
+            memory_free(block_pointer[value]);
+            t = now_ns() - t;
+            add_sample(&free_samples, t);
+            memory_get_stats(&after);
+            if (after.nb_free_blocks > stats.nb_free_blocks) {
+                record(&free_lat[group(stats.nb_free_blocks)], t);
+            } else {
+                record(&merge_lat[group(stats.nb_free_blocks)], t);
+            }
+            block_pointer[value] = NULL;
+            break;
+        case 'q':
+            print_report();
+            return 0;
+        default:
+            break;
+        }
+    }
+    print_report();
+    return 0;
+}
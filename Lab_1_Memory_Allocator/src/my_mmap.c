@@ -1,5 +1,8 @@
+#define _GNU_SOURCE /* for mremap, MAP_HUGETLB and MAP_POPULATE */
+
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
 
 #include "my_mmap.h"
 #include "mem_alloc.h"
@@ -30,6 +33,9 @@ void *my_mmap(size_t size) {
                 0,
                 0);
 
+    if (res == MAP_FAILED) {
+        return NULL;
+    }
     if (res != NULL) {
         if (padding != 0) {
             res = (void*)((char*)res + padding);
@@ -51,4 +57,105 @@ int my_munmap(void *addr, size_t length) {
     }   
 
     return munmap(a, l);
+}
+
+void *my_mremap(void *addr, size_t old_length, size_t new_length) {
+    int padding;
+    void *res;
+
+    padding = pad(MEM_ALIGNMENT);
+    res = mremap((char*)addr - padding, old_length + padding, new_length + padding, MREMAP_MAYMOVE);
+    if (res == MAP_FAILED) {
+        return NULL;
+    }
+    res = (void*)((char*)res + padding);
+    assert(((unsigned long)res) % MEM_ALIGNMENT == 0);
+    return res;
+}
+
+/*
+ * Provisioning of the pages of the pool (see MEM_PAGES and MEM_PREFAULT
+ * in Makefile.config). Huge pages are 2MB long.
+ */
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+#if defined(MEM_HUGETLB)
+/* Huge pages are mapped and unmapped whole */
+#define POOL_LENGTH(l) (((l) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1))
+#else
+#define POOL_LENGTH(l) (l)
+#endif
+
+#if defined(MEM_THP)
+/*
+ * Transparent huge pages only back the parts of a mapping that are aligned
+ * on HUGE_PAGE_SIZE: a huge page more is mapped, and what lies around the
+ * aligned range is unmapped.
+ */
+static char *map_thp(size_t length, int flags) {
+    char *res, *aligned;
+
+    // The tail after the aligned range can only be unmapped from a page boundary
+    length = (length + 4095) & ~4095UL;
+    size_t over = length + HUGE_PAGE_SIZE;
+
+    res = mmap(NULL, over, PROT_READ | PROT_WRITE | PROT_EXEC, flags, -1, 0);
+    if (res == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    aligned = (char *)(((unsigned long)res + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    if (aligned != res) {
+        munmap(res, aligned - res);
+    }
+    munmap(aligned + length, res + over - (aligned + length));
+    madvise(aligned, length, MADV_HUGEPAGE);
+    return aligned;
+}
+#endif
+
+void *my_mmap_pool(size_t size) {
+    int padding = pad(MEM_ALIGNMENT);
+    size_t length = POOL_LENGTH(size + padding);
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    char *res;
+
+#if defined(MEM_PREFAULT) && !defined(MEM_THP)
+    flags |= MAP_POPULATE;
+#endif
+
+#if defined(MEM_HUGETLB)
+    int saved_errno = errno;
+    res = mmap(NULL, length, PROT_READ | PROT_WRITE | PROT_EXEC, flags | MAP_HUGETLB, -1, 0);
+    if (res == MAP_FAILED) {
+        // No huge page reserved (see /proc/sys/vm/nr_hugepages): 4KB pages are used instead
+        res = mmap(NULL, length, PROT_READ | PROT_WRITE | PROT_EXEC, flags, -1, 0);
+        if (res != MAP_FAILED) {
+            errno = saved_errno; // A successful allocation leaves errno as it was
+        }
+    }
+#elif defined(MEM_THP)
+    res = map_thp(length, flags);
+#else
+    res = mmap(NULL, length, PROT_READ | PROT_WRITE | PROT_EXEC, flags, -1, 0);
+#endif
+    if (res == MAP_FAILED) {
+        return NULL;
+    }
+
+#if defined(MEM_PREFAULT) && defined(MEM_THP)
+    // MAP_POPULATE would fault the pages in before madvise: they are touched once huge pages are enabled
+    for (size_t offset = 0; offset < length; offset += 4096) {
+        *(volatile char *)(res + offset) = 0;
+    }
+#endif
+
+    res += padding;
+    assert(((unsigned long)res) % MEM_ALIGNMENT == 0);
+    return res;
+}
+
+int my_munmap_pool(void *addr, size_t length) {
+    int padding = pad(MEM_ALIGNMENT);
+
+    return munmap((char*)addr - padding, POOL_LENGTH(length + padding));
 }
\ No newline at end of file
@@ -16,4 +16,21 @@ void *my_mmap(size_t size);
  */
 int my_munmap(void *addr, size_t length); 
 
+/*
+ * Resizes a region returned by my_mmap, moving it if needed. The pages
+ * are remapped, their content is not copied. Returns the new address of
+ * the region (a multiple of MEM_ALIGNMENT), or NULL if it failed (the
+ * region is then left untouched).
+ */
+void *my_mremap(void *addr, size_t old_length, size_t new_length);
+
+/*
+ * Same as my_mmap and my_munmap, for the chunks of the memory pool: the
+ * pages are provisioned as configured by MEM_PAGES (4KB pages, transparent
+ * huge pages or reserved huge pages) and MEM_PREFAULT (pages faulted in
+ * when the region is mapped rather than when they are first touched).
+ */
+void *my_mmap_pool(size_t size);
+int my_munmap_pool(void *addr, size_t length);
+
 #endif      /* !_MY_MMAP_H_ */